@@ -26,99 +26,47 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifndef NO_HEAP
 #include <stdlib.h>
+#endif
 #include <string.h>
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
-#include <util/atomic.h>
+#include <avr/sleep.h>
 
 #include "avr_thread.h"
+#ifdef AVR_THREAD_HOST
+#include "avr_thread_host.h"
+#endif
 
+#ifdef AVR_THREAD_HOST
+/*
+ * On the host, the stack also has to hold the ucontext and the signal
+ * frames of the timebase.
+ */
+#define IDLE_THREAD_STACK_SIZE 16384
+#else
 #define IDLE_THREAD_STACK_SIZE 60
+#endif
 
-#define MAX_READER 10
-
-/**
- * Data structures
- * ===============
- * Here are the _definition_ of data structures.
+/*
+ * avr_thread_rwlock.state while a writer holds the lock.
  */
+#define RWLOCK_WRITER 0xff
 
 /*
- * States of a thread
+ * Number of slots in the timing wheel, one millisecond each. Must be a
+ * power of two no greater than 16.
  */
-enum avr_thread_state {
-    ats_invalid,                /* Cannot be run (stopped or
-                                 * uninitialised) */
-    ats_runnable,               /* Can be run */
-    ats_paused,                 /* Pausing, is not runnable until
-                                 * resume() */
-    ats_sleeping,               /* Sleeping, not runnable until timer
-                                 * runs off */
-    ats_joined,                 /* Joined to another thread, is not
-                                 * runnable until that thread stops */
-    ats_cancelled,              /* Cancelle by a thread */
-    ats_waiting                 /* Waiting to lock a mutex or a
-                                 * semaphore */
-};
+#define WHEEL_SIZE 16
 
-struct avr_thread {
-    /*
-     * I am WARNING you: DO NOT TOUCH THESE MEMBERS in your program.
-     */
-    volatile enum avr_thread_state state;
-    uint8_t        *stack;      /* Debug purpose */
-    uint16_t        stack_size; /* Debug purpose */
-    uint8_t        *sp;         /* Saved stack pointer */
-    volatile uint8_t ticks;     /* Timer */
-    volatile uint8_t quantum;
-    volatile enum avr_thread_priority priority;
-    volatile uint16_t sleep_ticks;      /* Timer for sleeping */
-    volatile struct avr_thread *run_queue_prev;
-    volatile struct avr_thread *run_queue_next;
-    volatile struct avr_thread *sleep_queue_next;
-    volatile struct avr_thread *wait_queue_next;
-    volatile struct avr_thread *next_joined;
-#ifdef SANITY
-    void           *owning;
+#ifdef TRACE
+#define AVR_THREAD_TRACE(event, t, arg) \
+    avr_thread_trace_record((event), (t), (arg))
+#else
+#define AVR_THREAD_TRACE(event, t, arg)
 #endif
-};
-
-struct avr_thread_mutex {
-    /*
-     * There will be a loop of this form:
-     *
-     * while (locked == 1) {
-     *     ... // This is _not_ a busy waiting!
-     * }
-     *
-     * Hence, `locked' must be `volatile'.
-     *
-     */
-    volatile uint8_t locked;
-    volatile struct avr_thread *wait_queue;
-};
-
-struct avr_thread_semaphore {
-    /*
-     * I know you may not listen, yet do NOT touch these members.
-     */
-    volatile struct avr_thread_mutex *mutex;
-    volatile uint8_t lock_count;
-    volatile struct avr_thread *wait_queue;
-};
-
-struct avr_thread_rwlock {
-    /*
-     * I know you may not listen, yet do NOT touch these members.
-     */
-    volatile struct avr_thread_mutex *mutex;
-    volatile struct avr_thread_semaphore *writer_sem;
-    volatile struct avr_thread_semaphore *reader_sem;
-    volatile int8_t num_reader;
-    volatile int8_t num_waiting_reader;
-};
 
 /**
  * Variables
@@ -126,27 +74,96 @@ struct avr_thread_rwlock {
  */
 volatile uint8_t avr_thread_initialised = 0;
 
+volatile uint32_t avr_thread_clock = 0;
+
+volatile uint16_t avr_thread_tick_countdown = 0;
+
+/*
+ * Length of a tick in milliseconds.
+ */
+static volatile uint16_t avr_thread_tick_ms = TIMEBASE_HZ / FIRE_PER_SEC;
+
+/*
+ * The value of avr_thread_clock when the kernel last caught up with it.
+ * The timing wheel has been processed up to this point.
+ */
+static uint32_t avr_thread_clock_synced = 0;
+
 static struct avr_thread *avr_thread_main_thread;
 
 static struct avr_thread *avr_thread_idle_thread;
 
+static struct avr_thread avr_thread_main_storage;
+
+static struct avr_thread avr_thread_idle_storage;
+
 static volatile struct avr_thread *avr_thread_active_thread;
 
 static volatile struct avr_thread *avr_thread_prev_thread;
 
-static volatile struct avr_thread *avr_thread_run_queue;
+/*
+ * The run queue is one FIFO per priority level. Bit `n' of the bitmap is
+ * set if and only if the FIFO of level `n' is not empty, so the highest
+ * runnable level can be found without walking any list.
+ */
+static volatile struct avr_thread *avr_thread_run_queue_head[NUM_PRIORITIES];
+
+static volatile struct avr_thread *avr_thread_run_queue_tail[NUM_PRIORITIES];
+
+static volatile uint8_t avr_thread_run_queue_bitmap;
 
-static volatile struct avr_thread *avr_thread_sleep_queue;
+/*
+ * Index of the most significant bit set in a nibble.
+ */
+static const uint8_t avr_thread_msb_table[16] = {
+    0, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3
+};
+
+/*
+ * The sleep queue is a hashed timing wheel: a sleeping thread is linked
+ * into slot `wake_time % WHEEL_SIZE', and bit `n' of the bitmap is set
+ * if and only if slot `n' is not empty. Threads sleeping longer than one
+ * revolution simply stay in their slot until their round comes.
+ */
+static volatile struct avr_thread *avr_thread_wheel[WHEEL_SIZE];
+
+static volatile uint16_t avr_thread_wheel_bitmap;
 
 static uint8_t  avr_thread_idle_stack[IDLE_THREAD_STACK_SIZE];
 
+#ifdef TRACE
+/*
+ * Trace records between `head' (oldest) and `tail'. One slot is always
+ * left empty to tell a full buffer from an empty one.
+ */
+static volatile struct avr_thread_trace_record
+                avr_thread_trace_ring[TRACE_SIZE];
+
+static volatile uint8_t avr_thread_trace_head;
+
+static volatile uint8_t avr_thread_trace_tail;
+
+/*
+ * Number of records dropped since the buffer was last full.
+ */
+static volatile uint8_t avr_thread_trace_lost;
+
+static uint8_t  avr_thread_trace_next_id;
+#endif
+
 /*
  * Note:
  * These two `functions' are actually assembly procedures. There are
  * in `avr_thread_switch.S'. I put a prototype here so that the compiler
  * can check the type for me.
+ *
+ * avr_thread_switch_to() saves only what a function call does not
+ * clobber. Pass ATF_LEAN_FRAME of the thread being resumed as `lean' so
+ * that only that is restored, too.
  */
-void            avr_thread_switch_to(uint8_t * new_stack_pointer);
+void            avr_thread_switch_to(uint8_t * new_stack_pointer,
+                                     uint8_t * volatile *save_sp,
+                                     uint8_t lean);
 void            avr_thread_switch_to_without_save(uint8_t *
                                                   new_stack_pointer);
 
@@ -162,11 +179,103 @@ static volatile struct avr_thread *avr_thread_run_queue_pop(void);
 static void     avr_thread_run_queue_remove(volatile
                                             struct avr_thread *t);
 
+static uint8_t  avr_thread_run_queue_top(void);
+
+static void     avr_thread_sleep_queue_insert(volatile
+                                              struct avr_thread *t,
+                                              uint32_t wake_time);
+
 static void     avr_thread_sleep_queue_remove(volatile
                                               struct avr_thread *t);
 
+static void     avr_thread_sleep_queue_expire(uint8_t slot,
+                                              uint32_t now);
+
+static void     avr_thread_reset_quantum(volatile struct avr_thread *t);
+
+static void     avr_thread_set_priority(volatile struct avr_thread *t,
+                                        enum avr_thread_priority
+                                        priority);
+
+static void     avr_thread_wait_queue_push(volatile struct
+                                           avr_thread_wait_queue *q,
+                                           volatile struct avr_thread *t);
+
+static void     avr_thread_wait_queue_remove(volatile struct
+                                             avr_thread_wait_queue *q,
+                                             volatile struct avr_thread
+                                             *t);
+
+static volatile struct avr_thread *avr_thread_wait_queue_pop_best(volatile
+                                                                  struct
+                                                                  avr_thread_wait_queue
+                                                                  *q);
+
+static uint8_t  avr_thread_wait_queue_wake(volatile struct
+                                           avr_thread_wait_queue *q);
+
+static uint8_t  avr_thread_wait_begin(volatile struct
+                                      avr_thread_wait_queue *q,
+                                      enum avr_thread_state state,
+                                      uint8_t timed, uint32_t deadline);
+
+static enum avr_thread_wait_result avr_thread_wait_end(void);
+
+static void     avr_thread_mutex_inherit(volatile struct avr_thread_mutex
+                                         *mutex);
+
+static void     avr_thread_mutex_disinherit(volatile struct avr_thread
+                                            *t,
+                                            volatile struct
+                                            avr_thread_mutex *mutex);
+
+static void     avr_thread_mutex_reinherit(volatile struct
+                                           avr_thread_mutex *mutex);
+
+static enum avr_thread_wait_result avr_thread_mutex_lock_common(volatile
+                                                                struct
+                                                                avr_thread_mutex
+                                                                *mutex,
+                                                                uint8_t
+                                                                timed,
+                                                                uint32_t
+                                                                deadline);
+
+static uint8_t  avr_thread_sem_post(volatile struct avr_thread_semaphore
+                                    *sem);
+
+static enum avr_thread_wait_result avr_thread_sem_down_common(volatile
+                                                              struct
+                                                              avr_thread_semaphore
+                                                              *sem,
+                                                              uint8_t timed,
+                                                              uint32_t
+                                                              deadline);
+
+static enum avr_thread_wait_result avr_thread_join_common(struct avr_thread
+                                                          *t,
+                                                          uint8_t timed,
+                                                          uint32_t
+                                                          deadline);
+
+static void     avr_thread_release_joiners(volatile struct avr_thread *t);
+
 static void     avr_thread_idle_thread_entry(void);
 
+static void     avr_thread_stack_check(volatile struct avr_thread *t);
+
+#ifdef TRACE
+static void     avr_thread_trace_record(uint8_t event,
+                                        volatile struct avr_thread *t,
+                                        uint8_t arg);
+#endif
+
+static void     avr_thread_clock_sync(void);
+
+static void     avr_thread_clock_reprogram(void);
+
+static void     avr_thread_clock_tick_soon(void);
+
 /*
  * Initialise a particular thread. Do not confuse this with
  * avr_thread_init(), which is used to initialise the whole library.
@@ -181,7 +290,83 @@ static void     avr_thread_init_thread(volatile
 
 static void     avr_thread_self_deconstruct(void);
 
-static int8_t   avr_thread_atomic_add(int8_t x, int8_t delta);
+static void     avr_thread_rwlock_grant_readers(volatile struct
+                                                avr_thread_rwlock *rwlock);
+
+static void     avr_thread_rwlock_release(volatile struct avr_thread_rwlock
+                                          *rwlock);
+
+static enum avr_thread_wait_result avr_thread_rwlock_rdlock_common(volatile
+                                                                   struct
+                                                                   avr_thread_rwlock
+                                                                   *rwlock,
+                                                                   uint8_t
+                                                                   timed,
+                                                                   uint32_t
+                                                                   deadline);
+
+static enum avr_thread_wait_result avr_thread_rwlock_wrlock_common(volatile
+                                                                   struct
+                                                                   avr_thread_rwlock
+                                                                   *rwlock,
+                                                                   uint8_t
+                                                                   timed,
+                                                                   uint32_t
+                                                                   deadline);
+
+static uint8_t  avr_thread_event_wait_common(volatile struct
+                                             avr_thread_event *event,
+                                             uint8_t mask, uint8_t options,
+                                             uint8_t timed,
+                                             uint32_t deadline);
+
+static void     avr_thread_event_post(volatile struct avr_thread_event
+                                      *event, uint8_t bits);
+
+static enum avr_thread_wait_result avr_thread_cond_wait_common(volatile
+                                                               struct
+                                                               avr_thread_cond
+                                                               *cond,
+                                                               volatile
+                                                               struct
+                                                               avr_thread_mutex
+                                                               *mutex,
+                                                               uint8_t
+                                                               timed,
+                                                               uint32_t
+                                                               deadline);
+
+static void     avr_thread_cond_wake(volatile struct avr_thread_cond
+                                     *cond, uint8_t all);
+
+static void     avr_thread_queue_put(volatile struct avr_thread_queue
+                                     *queue, const void *item);
+
+static void     avr_thread_queue_get(volatile struct avr_thread_queue
+                                     *queue, void *item);
+
+
+static enum avr_thread_wait_result avr_thread_queue_send_common(volatile
+                                                                struct
+                                                                avr_thread_queue
+                                                                *queue,
+                                                                const void
+                                                                *item,
+                                                                uint8_t
+                                                                timed,
+                                                                uint32_t
+                                                                deadline);
+
+static enum avr_thread_wait_result avr_thread_queue_receive_common(volatile
+                                                                   struct
+                                                                   avr_thread_queue
+                                                                   *queue,
+                                                                   void
+                                                                   *item,
+                                                                   uint8_t
+                                                                   timed,
+                                                                   uint32_t
+                                                                   deadline);
 
 /**
  * Implementations
@@ -189,14 +374,150 @@ static int8_t   avr_thread_atomic_add(int8_t x, int8_t delta);
  */
 
 /*
- * Does nothing except yielding.
+ * Puts the CPU in idle sleep while nothing is runnable. Any interrupt
+ * wakes it up again; if that interrupt made a thread runnable, the CPU
+ * is handed over.
  */
 static void
 avr_thread_idle_thread_entry(void)
 {
+    set_sleep_mode(SLEEP_MODE_IDLE);
     for (;;) {
-        avr_thread_yield();
+        cli();
+        if (avr_thread_run_queue_bitmap == 0) {
+            sleep_enable();
+            /*
+             * The instruction following `sei' is always executed before
+             * any pending interrupt, so a wake-up cannot slip in between.
+             */
+            sei();
+            sleep_cpu();
+            sleep_disable();
+        } else {
+            sei();
+            avr_thread_yield();
+        }
+    }
+}
+
+/*
+ * Catches up with avr_thread_clock: wakes up the sleeping threads whose
+ * timers ran off and charges the active thread's quantum for the time
+ * that has passed since the last call.
+ *
+ * At most one revolution of the wheel is visited, however long it has
+ * been, because by then every slot has been looked at once.
+ *
+ * Must be called with interrupts disabled.
+ */
+static void
+avr_thread_clock_sync(void)
+{
+    uint32_t        now,
+                    elapsed;
+    uint8_t         n,
+                    slot;
+
+    now = avr_thread_clock;
+    elapsed = now - avr_thread_clock_synced;
+
+    if (elapsed == 0) {
+        return;
+    }
+
+    if (elapsed >= avr_thread_active_thread->ticks) {
+        avr_thread_active_thread->ticks = 0;
+    } else {
+        avr_thread_active_thread->ticks -= elapsed;
+    }
+
+    if (avr_thread_wheel_bitmap != 0) {
+        n = elapsed > WHEEL_SIZE ? WHEEL_SIZE : (uint8_t) elapsed;
+        slot = (uint8_t) avr_thread_clock_synced;
+        while (n-- > 0) {
+            slot = (slot + 1) & (WHEEL_SIZE - 1);
+            if (avr_thread_wheel_bitmap & (1U << slot)) {
+                avr_thread_sleep_queue_expire(slot, now);
+            }
+        }
+    }
+
+    avr_thread_clock_synced = now;
+}
+
+/*
+ * Works out how many milliseconds may pass before the scheduler has
+ * something to do and programs avr_thread_tick_countdown accordingly:
+ *
+ *  1. a thread with a higher priority is runnable: on the next interrupt;
+ *  2. the first non-empty slot of the timing wheel comes round;
+ *  3. another thread of the same priority is runnable: when the quantum
+ *  of the active thread runs out.
+ *
+ * If none of them holds, no tick is needed at all.
+ *
+ * Must be called with interrupts disabled.
+ */
+static void
+avr_thread_clock_reprogram(void)
+{
+    uint16_t        next;
+    uint8_t         prio,
+                    slot,
+                    i;
+
+    avr_thread_clock_sync();
+
+    next = 0;
+    prio = avr_thread_active_thread->priority;
+
+    if (avr_thread_run_queue_bitmap != 0 &&
+        (avr_thread_active_thread == avr_thread_idle_thread ||
+         avr_thread_run_queue_top() > prio)) {
+        next = 1;
+    } else {
+        if (avr_thread_wheel_bitmap != 0) {
+            slot = (uint8_t) avr_thread_clock_synced;
+            for (i = 1; i <= WHEEL_SIZE; ++i) {
+                if (avr_thread_wheel_bitmap &
+                    (1U << ((slot + i) & (WHEEL_SIZE - 1)))) {
+                    next = i;
+                    break;
+                }
+            }
+        }
+        if (avr_thread_active_thread != avr_thread_idle_thread &&
+            avr_thread_run_queue_head[prio] != NULL) {
+            if (avr_thread_active_thread->ticks == 0) {
+                next = 1;
+            } else if (next == 0 ||
+                       avr_thread_active_thread->ticks < next) {
+                next = avr_thread_active_thread->ticks;
+            }
+        }
     }
+
+    avr_thread_tick_countdown = next;
+}
+
+/*
+ * Makes sure avr_thread_tick() runs on the next timebase interrupt.
+ *
+ * Must be called with interrupts disabled.
+ */
+static void
+avr_thread_clock_tick_soon(void)
+{
+    avr_thread_tick_countdown = 1;
+}
+
+/*
+ * Gives a thread a fresh quantum.
+ */
+static void
+avr_thread_reset_quantum(volatile struct avr_thread *t)
+{
+    t->ticks = t->quantum * avr_thread_tick_ms;
 }
 
 /*
@@ -207,28 +528,9 @@ avr_thread_idle_thread_entry(void)
 static void
 avr_thread_self_deconstruct(void)
 {
-    volatile struct avr_thread *t;
-
     avr_thread_run_queue_remove(avr_thread_active_thread);
     avr_thread_sleep_queue_remove(avr_thread_active_thread);
-
-    t = avr_thread_active_thread->next_joined;
-
-    /*
-     * Marks the threads that are joined to the current thread active
-     * and push the threads to the run queue.
-     */
-    while (t != NULL) {
-        /*
-         * The thread that joined to the current thread may be cancelled
-         * by another thread...
-         */
-        if (t->state == ats_joined) {
-            t->state = ats_runnable;
-            avr_thread_run_queue_push(t);
-        }
-        t = t->next_joined;
-    }
+    avr_thread_release_joiners(avr_thread_active_thread);
 
     avr_thread_active_thread->state = ats_invalid;
     avr_thread_yield();
@@ -239,27 +541,44 @@ avr_thread_init(uint16_t main_stack_size,
                 enum avr_thread_priority main_priority)
 {
     uint8_t         sreg;
+    uint8_t         i;
 
     sreg = SREG;
     cli();
 
-    avr_thread_run_queue = NULL;
-    avr_thread_sleep_queue = NULL;
+    for (i = 0; i < NUM_PRIORITIES; ++i) {
+        avr_thread_run_queue_head[i] = NULL;
+        avr_thread_run_queue_tail[i] = NULL;
+    }
+    avr_thread_run_queue_bitmap = 0;
+    for (i = 0; i < WHEEL_SIZE; ++i) {
+        avr_thread_wheel[i] = NULL;
+    }
+    avr_thread_wheel_bitmap = 0;
+    avr_thread_clock_synced = avr_thread_clock;
 
-    avr_thread_main_thread = avr_thread_create(NULL, NULL,
-                                               main_stack_size,
-                                               main_priority);
+    avr_thread_main_thread =
+        avr_thread_create_static(&avr_thread_main_storage, NULL, NULL,
+                                 main_stack_size, main_priority);
 
     avr_thread_idle_thread =
-        avr_thread_create(avr_thread_idle_thread_entry,
-                          avr_thread_idle_stack,
-                          sizeof(avr_thread_idle_stack), atp_normal);
+        avr_thread_create_static(&avr_thread_idle_storage,
+                                 avr_thread_idle_thread_entry,
+                                 avr_thread_idle_stack,
+                                 sizeof(avr_thread_idle_stack),
+                                 atp_normal);
 
     if (avr_thread_idle_thread == NULL ||
         avr_thread_main_thread == NULL) {
         goto error;
     }
 
+    /*
+     * The idle thread never sits in the run queue. It is what
+     * avr_thread_run_queue_pop() returns when the queue is empty.
+     */
+    avr_thread_run_queue_remove(avr_thread_idle_thread);
+
     avr_thread_prev_thread = avr_thread_main_thread;
     avr_thread_active_thread = avr_thread_idle_thread;
 
@@ -267,7 +586,22 @@ avr_thread_init(uint16_t main_stack_size,
      * Force a context switch so that the data in the main thread is
      * set properly.
      */
-    avr_thread_switch_to(avr_thread_active_thread->sp);
+    avr_thread_main_thread->flags |= ATF_LEAN_FRAME;
+    avr_thread_switch_to(avr_thread_active_thread->sp,
+                         &avr_thread_main_thread->sp, 0);
+
+#ifdef AVR_THREAD_HOST
+    avr_thread_host_timebase_init();
+#else
+    /*
+     * Timer0 in CTC mode, clk/64, one interrupt per timebase period.
+     */
+    TCCR0A = (1 << WGM01);
+    TCCR0B = (1 << CS01) | (1 << CS00);
+    OCR0A = F_CPU / 64 / TIMEBASE_HZ - 1;
+    TCNT0 = 0;
+    TIMSK0 = (1 << OCIE0A);
+#endif
 
     avr_thread_initialised = 1;
     SREG = sreg;
@@ -279,6 +613,7 @@ avr_thread_init(uint16_t main_stack_size,
     return NULL;
 }
 
+#ifndef NO_HEAP
 struct avr_thread *
 avr_thread_create(void (*entry) (void), uint8_t * stack,
                   uint16_t stack_size,
@@ -290,19 +625,46 @@ avr_thread_create(void (*entry) (void), uint8_t * stack,
     sreg = SREG;
     cli();
 
-    if (stack_size < 36) {
+    t = malloc(sizeof(struct avr_thread));
+
+    if (t == NULL) {
         SREG = sreg;
         return NULL;
     }
 
-    t = malloc(sizeof(struct avr_thread));
+    if (avr_thread_create_static(t, entry, stack, stack_size,
+                                 priority) == NULL) {
+        free(t);
+        SREG = sreg;
+        return NULL;
+    }
+    t->flags &= ~ATF_STATIC;
 
-    if (t == NULL) {
+    SREG = sreg;
+    return t;
+}
+#endif
+
+struct avr_thread *
+avr_thread_create_static(struct avr_thread *t, void (*entry) (void),
+                         uint8_t * stack, uint16_t stack_size,
+                         enum avr_thread_priority priority)
+{
+    uint8_t         sreg;
+
+    sreg = SREG;
+    cli();
+
+    if (t == NULL || stack_size <= MIN_STACK_SIZE) {
         SREG = sreg;
         return NULL;
     }
 
     avr_thread_init_thread(t, entry, stack, stack_size, priority);
+    t->flags = ATF_STATIC;
+#ifdef TRACE
+    t->id = avr_thread_trace_next_id++;
+#endif
     t->state = ats_runnable;
     avr_thread_run_queue_push(t);
 
@@ -321,12 +683,31 @@ avr_thread_init_thread(volatile struct avr_thread *t,
                        uint16_t stack_size,
                        enum avr_thread_priority priority)
 {
+#ifndef AVR_THREAD_HOST
     uint8_t         i;
+#endif
+    uint8_t        *p;
 
     if (stack_size <= MIN_STACK_SIZE) {
         return;
     }
 
+#ifdef AVR_THREAD_HOST
+    /*
+     * The frame is a ucontext at the top of the stack. The main thread
+     * keeps running on the process stack, which is not checked.
+     */
+    if (stack != NULL) {
+        for (p = stack; p < stack + stack_size; ++p) {
+            *p = STACK_PAINT;
+        }
+    }
+    t->stack = stack;
+    t->stack_size = stack_size;
+    t->sp = avr_thread_host_context_init(entry,
+                                         avr_thread_self_deconstruct,
+                                         stack, stack_size);
+#else
     if (stack == NULL) {
         stack = (uint8_t *) (SP - stack_size - 2);
     }
@@ -361,12 +742,35 @@ avr_thread_init_thread(volatile struct avr_thread *t,
         --(t->sp);
     }
 
+    /*
+     * Paint the rest of the stack. This must not call anything: for the
+     * main thread, the stack is the memory right below our own frame.
+     */
+    for (p = stack; p <= t->sp; ++p) {
+        *p = STACK_PAINT;
+    }
+#endif
+
     t->priority = priority;
+    t->base_priority = priority;
     t->quantum = DEFAULT_QUANTUM;
-    t->ticks = t->quantum;
+    avr_thread_reset_quantum(t);
     t->state = ats_runnable;
 
-    t->next_joined = NULL;
+    t->run_queue_prev = NULL;
+    t->run_queue_next = NULL;
+    t->sleep_queue_prev = NULL;
+    t->sleep_queue_next = NULL;
+    t->joiners.head = NULL;
+    t->joiners.tail = NULL;
+    t->waiting_in = NULL;
+    t->blocked_on = NULL;
+    t->held_mutexes = NULL;
+    t->period = 0;
+    t->period_stats.releases = 0;
+    t->period_stats.misses = 0;
+    t->period_stats.last_jitter = 0;
+    t->period_stats.max_jitter = 0;
 #ifdef SANITY
     t->owning = NULL;
 #endif
@@ -377,24 +781,24 @@ avr_thread_init_thread(volatile struct avr_thread *t,
 uint8_t        *
 avr_thread_tick(uint8_t * saved_sp)
 {
-    volatile struct avr_thread *t;
-
     avr_thread_active_thread->sp = saved_sp;
+    avr_thread_active_thread->flags &= ~ATF_LEAN_FRAME;
+    avr_thread_stack_check(avr_thread_active_thread);
 
     /*
-     * Check if any sleeping thread can be waken.
+     * Wake up the sleeping threads whose timers are off and charge the
+     * active thread for the time that has passed.
      */
-    if (avr_thread_sleep_queue != NULL) {
-        --(avr_thread_sleep_queue->sleep_ticks);
-        while (avr_thread_sleep_queue != NULL &&
-               avr_thread_sleep_queue->sleep_ticks == 0) {
-            avr_thread_sleep_queue->state = ats_runnable;
-            avr_thread_run_queue_push(avr_thread_sleep_queue);
-            t = avr_thread_sleep_queue;
-            avr_thread_sleep_queue =
-                avr_thread_sleep_queue->sleep_queue_next;
-            t->sleep_queue_next = NULL;
-        }
+    avr_thread_clock_sync();
+
+    /*
+     * A thread may be interrupted between marking itself as not runnable
+     * and calling avr_thread_yield(). Such a thread is already in some
+     * other queue and must not be put back to the run queue.
+     */
+    if (avr_thread_active_thread->state != ats_runnable) {
+        avr_thread_clock_reprogram();
+        return avr_thread_active_thread->sp;
     }
 
     /*
@@ -402,105 +806,251 @@ avr_thread_tick(uint8_t * saved_sp)
      * switch to it.
      * Warning: starvation is highly possible.
      */
-    if (avr_thread_run_queue->priority >
-        avr_thread_active_thread->priority) {
+    if (avr_thread_run_queue_bitmap != 0 &&
+        (avr_thread_active_thread == avr_thread_idle_thread ||
+         avr_thread_run_queue_top() >
+         avr_thread_active_thread->priority)) {
         avr_thread_prev_thread = avr_thread_active_thread;
-        avr_thread_active_thread = avr_thread_run_queue_pop();
         avr_thread_run_queue_push(avr_thread_prev_thread);
-        avr_thread_prev_thread->ticks =
-            avr_thread_prev_thread->quantum;
-        avr_thread_active_thread->ticks =
-            avr_thread_active_thread->quantum;
+        avr_thread_active_thread = avr_thread_run_queue_pop();
+        avr_thread_reset_quantum(avr_thread_prev_thread);
+        avr_thread_reset_quantum(avr_thread_active_thread);
+        AVR_THREAD_TRACE(ate_switch, avr_thread_active_thread, 0);
     } else {
-        --(avr_thread_active_thread->ticks);
-        if (avr_thread_active_thread->ticks <= 0) {
+        if (avr_thread_active_thread->ticks == 0) {
+            /*
+             * Round robin among the threads of the same priority. If
+             * the active thread is alone at its level, it is pushed and
+             * popped straight back.
+             */
             avr_thread_prev_thread = avr_thread_active_thread;
-            avr_thread_active_thread = avr_thread_run_queue_pop();
             avr_thread_run_queue_push(avr_thread_prev_thread);
-            avr_thread_prev_thread->ticks =
-                avr_thread_prev_thread->quantum;
-            avr_thread_active_thread->ticks =
-                avr_thread_active_thread->quantum;
+            avr_thread_active_thread = avr_thread_run_queue_pop();
+            avr_thread_reset_quantum(avr_thread_prev_thread);
+            avr_thread_reset_quantum(avr_thread_active_thread);
+#ifdef TRACE
+            if (avr_thread_active_thread != avr_thread_prev_thread) {
+                AVR_THREAD_TRACE(ate_switch, avr_thread_active_thread,
+                                 0);
+            }
+#endif
         }
     }
 
+    avr_thread_clock_reprogram();
     return avr_thread_active_thread->sp;
 }
 
-void
-avr_thread_sleep(uint16_t ticks)
+uint8_t        *
+avr_thread_isr_exit(uint8_t * saved_sp)
 {
-    volatile struct avr_thread *t,
-                   *p;
-
-    uint8_t         sreg;
-
-    sreg = SREG;
-    cli();
-
     /*
-     * Sleep queue is empty.
+     * The handler woke up somebody who should preempt: do what the
+     * timebase would have done at its next interrupt.
      */
-    if (avr_thread_sleep_queue == NULL) {
-        avr_thread_sleep_queue = avr_thread_active_thread;
-        avr_thread_active_thread->sleep_queue_next = NULL;
-        avr_thread_active_thread->sleep_ticks = ticks;
-        goto _exit_from_sleep;
+    if (avr_thread_run_queue_bitmap != 0 &&
+        (avr_thread_active_thread == avr_thread_idle_thread ||
+         avr_thread_run_queue_top() >
+         avr_thread_active_thread->priority)) {
+        return avr_thread_tick(saved_sp);
     }
+    return saved_sp;
+}
 
-    /*
-     * Sleep queue is not empty.
-     * Find a space
-     */
-    for (p = NULL, t = avr_thread_sleep_queue; t != NULL;) {
-        if (ticks < t->sleep_ticks) {
-            t->sleep_ticks -= ticks;
-            avr_thread_active_thread->sleep_queue_next = t;
-            avr_thread_active_thread->sleep_ticks = ticks;
-            if (p != NULL) {
-                p->sleep_queue_next = avr_thread_active_thread;
-            } else {
-                avr_thread_sleep_queue = avr_thread_active_thread;
-            }
-            goto _exit_from_sleep;
-        }
-        ticks -= t->sleep_ticks;
-        p = t;
-        t = t->sleep_queue_next;
+void
+avr_thread_set_tick_rate(uint16_t ticks_per_sec)
+{
+    if (ticks_per_sec == 0) {
+        ticks_per_sec = 1;
+    } else if (ticks_per_sec > TIMEBASE_HZ) {
+        ticks_per_sec = TIMEBASE_HZ;
     }
+    avr_thread_tick_ms = TIMEBASE_HZ / ticks_per_sec;
+}
 
-    /*
-     * Tail of the sleep queue.
-     */
-    p->sleep_queue_next = avr_thread_active_thread;
-    avr_thread_active_thread->sleep_queue_next = NULL;
-    avr_thread_active_thread->sleep_ticks = ticks;
+uint32_t
+avr_thread_now(void)
+{
+    uint32_t        now;
+    uint8_t         sreg;
 
-  _exit_from_sleep:
-    avr_thread_active_thread->state = ats_sleeping;
-    avr_thread_yield();
+    sreg = SREG;
+    cli();
+    now = avr_thread_clock;
     SREG = sreg;
-    return;
+    return now;
 }
 
+void
+avr_thread_sleep(uint16_t ticks)
+{
+    avr_thread_sleep_ms((uint32_t) ticks * avr_thread_tick_ms);
+}
 
 void
-avr_thread_exit(void)
+avr_thread_sleep_ms(uint32_t ms)
 {
-    /*
-     * Cannot exit the main thread.
-     */
-    if (avr_thread_active_thread != avr_thread_main_thread) {
-        avr_thread_self_deconstruct();
-    }
+    avr_thread_sleep_until(avr_thread_now() + ms);
 }
 
-/*
- * Cancel a thread.
- * Make it as cancelled and move on.
- */
-int8_t
-avr_thread_cancel(struct avr_thread *t)
+void
+avr_thread_sleep_until(uint32_t wake_time)
+{
+    uint8_t         sreg;
+
+    sreg = SREG;
+    cli();
+
+    avr_thread_clock_sync();
+
+    /*
+     * If the deadline has already passed, the yield below just gives
+     * others a chance.
+     */
+    if ((int32_t) (wake_time - avr_thread_clock_synced) > 0) {
+        avr_thread_sleep_queue_insert(avr_thread_active_thread,
+                                      wake_time);
+        avr_thread_active_thread->state = ats_sleeping;
+    }
+    avr_thread_yield();
+
+    SREG = sreg;
+    return;
+}
+
+#ifndef NO_HEAP
+struct avr_thread *
+avr_thread_create_periodic(void (*entry) (void), uint8_t * stack,
+                           uint16_t stack_size,
+                           enum avr_thread_priority priority,
+                           uint16_t period)
+{
+    uint8_t         sreg;
+    struct avr_thread *t;
+
+    sreg = SREG;
+    cli();
+
+    t = avr_thread_create(entry, stack, stack_size, priority);
+    if (t != NULL) {
+        t->period = period;
+        t->release = avr_thread_clock;
+    }
+
+    SREG = sreg;
+    return t;
+}
+#endif
+
+struct avr_thread *
+avr_thread_create_periodic_static(struct avr_thread *t,
+                                  void (*entry) (void), uint8_t * stack,
+                                  uint16_t stack_size,
+                                  enum avr_thread_priority priority,
+                                  uint16_t period)
+{
+    uint8_t         sreg;
+
+    sreg = SREG;
+    cli();
+
+    /*
+     * Interrupts stay disabled, so the thread cannot run before it knows
+     * its period.
+     */
+    t = avr_thread_create_static(t, entry, stack, stack_size, priority);
+    if (t != NULL) {
+        t->period = period;
+        t->release = avr_thread_clock;
+    }
+
+    SREG = sreg;
+    return t;
+}
+
+void
+avr_thread_wait_next_period(void)
+{
+    uint8_t         sreg;
+    uint32_t        now,
+                    late;
+    volatile struct avr_thread *t;
+    volatile struct avr_thread_period_stats *stats;
+
+    sreg = SREG;
+    cli();
+
+    t = avr_thread_active_thread;
+    if (t->period == 0) {
+        avr_thread_yield();
+        SREG = sreg;
+        return;
+    }
+
+    avr_thread_clock_sync();
+    now = avr_thread_clock_synced;
+    stats = &t->period_stats;
+    t->release += t->period;
+
+    if ((int32_t) (t->release - now) > 0) {
+        avr_thread_sleep_queue_insert(t, t->release);
+        t->state = ats_sleeping;
+        avr_thread_yield();
+        now = avr_thread_clock;
+    } else if (t->release != now) {
+        /*
+         * Overran into the next period. Start the latest one that has
+         * begun rather than running the ones that were missed back to
+         * back.
+         */
+        late = (now - t->release) / t->period;
+        t->release += late * t->period;
+        stats->misses += (uint16_t) late + 1;
+    }
+
+    late = now - t->release;
+    ++stats->releases;
+    stats->last_jitter = late > UINT16_MAX ? UINT16_MAX : (uint16_t) late;
+    if (stats->last_jitter > stats->max_jitter) {
+        stats->max_jitter = stats->last_jitter;
+    }
+
+    SREG = sreg;
+}
+
+void
+avr_thread_period_stats(struct avr_thread *t,
+                        struct avr_thread_period_stats *stats)
+{
+    uint8_t         sreg;
+
+    if (t == NULL || stats == NULL) {
+        return;
+    }
+
+    sreg = SREG;
+    cli();
+    *stats = t->period_stats;
+    SREG = sreg;
+}
+
+void
+avr_thread_exit(void)
+{
+    /*
+     * Cannot exit the main thread.
+     */
+    if (avr_thread_active_thread != avr_thread_main_thread) {
+        avr_thread_self_deconstruct();
+    }
+}
+
+/*
+ * Cancel a thread.
+ * Make it as cancelled and move on.
+ */
+int8_t
+avr_thread_cancel(struct avr_thread *t)
 {
     uint8_t         sreg;
 
@@ -529,26 +1079,26 @@ avr_thread_cancel(struct avr_thread *t)
 #endif
 
     t->state = ats_cancelled;
-
-    while (t->next_joined != NULL) {
-        if (t->next_joined->state == ats_joined) {
-            t->next_joined->state = ats_runnable;
-            avr_thread_run_queue_push(t->next_joined);
-        }
-        t->next_joined = t->next_joined->next_joined;
-    }
+    avr_thread_release_joiners(t);
 
     avr_thread_run_queue_remove(t);
     avr_thread_sleep_queue_remove(t);
+    if (t->waiting_in != NULL) {
+        avr_thread_wait_queue_remove(t->waiting_in, t);
+    }
 
     t->state = ats_invalid;
+#ifndef NO_HEAP
     /*
      * I know Gcc generates warning for the following line of code.
      * 
      * The problem is that if a thread is cancelled, what will happen to
      * its struct?
      */
-    free(t);
+    if (!(t->flags & ATF_STATIC)) {
+        free(t);
+    }
+#endif
 
     SREG = sreg;
     return 0;
@@ -593,6 +1143,7 @@ avr_thread_resume(struct avr_thread *t)
 
     t->state = ats_runnable;
     avr_thread_run_queue_push(t);
+    AVR_THREAD_TRACE(ate_wake, t, 0);
 
     if (t->priority > avr_thread_active_thread->priority) {
         avr_thread_yield();
@@ -615,6 +1166,9 @@ avr_thread_yield(void)
     sreg = SREG & 0x80;
     cli();
 
+    avr_thread_stack_check(avr_thread_active_thread);
+    avr_thread_clock_sync();
+
     /*
      * This function may be called directly from the active thread.
      * We need to put hte current thraed back to the run queue if the
@@ -623,45 +1177,76 @@ avr_thread_yield(void)
      */
     if (avr_thread_active_thread->state == ats_runnable) {
         avr_thread_run_queue_push(avr_thread_active_thread);
+    } else {
+        AVR_THREAD_TRACE(avr_thread_active_thread->state == ats_invalid ?
+                         ate_exit : ate_block, avr_thread_active_thread,
+                         avr_thread_active_thread->state);
     }
 
     t = avr_thread_run_queue_pop();
 
     if (t == avr_thread_active_thread) {
         // Reset the tick
-        avr_thread_active_thread->ticks =
-            avr_thread_active_thread->quantum;
+        avr_thread_reset_quantum(avr_thread_active_thread);
+        avr_thread_clock_reprogram();
     } else if (avr_thread_active_thread->state == ats_invalid) {
         /*
          * The active thread is self-deconstructing.
          */
         avr_thread_prev_thread = avr_thread_active_thread;
         avr_thread_active_thread = t;
-        free(avr_thread_prev_thread);
-        avr_thread_active_thread->ticks =
-            avr_thread_active_thread->quantum;
+#ifndef NO_HEAP
+        if (!(avr_thread_prev_thread->flags & ATF_STATIC)) {
+            free(avr_thread_prev_thread);
+        }
+#endif
+        avr_thread_reset_quantum(avr_thread_active_thread);
+        avr_thread_clock_reprogram();
+        AVR_THREAD_TRACE(ate_switch, avr_thread_active_thread, 0);
         avr_thread_switch_to_without_save
             (avr_thread_active_thread->sp);
     } else {
         avr_thread_prev_thread = avr_thread_active_thread;
         avr_thread_active_thread = t;
-        avr_thread_prev_thread->ticks =
-            avr_thread_prev_thread->quantum;
-        avr_thread_active_thread->ticks =
-            avr_thread_active_thread->quantum;
-        avr_thread_switch_to(avr_thread_active_thread->sp);
+        avr_thread_reset_quantum(avr_thread_prev_thread);
+        avr_thread_reset_quantum(avr_thread_active_thread);
+        avr_thread_clock_reprogram();
+        AVR_THREAD_TRACE(ate_switch, avr_thread_active_thread, 0);
+        avr_thread_prev_thread->flags |= ATF_LEAN_FRAME;
+        avr_thread_switch_to(avr_thread_active_thread->sp,
+                             &avr_thread_prev_thread->sp,
+                             avr_thread_active_thread->flags &
+                             ATF_LEAN_FRAME);
     }
 
+    /*
+     * A switch comes back through reti, with interrupts enabled. The
+     * caller may still be in a critical section, so disable them again
+     * and leave it to `sreg' to decide.
+     */
+    cli();
     SREG |= sreg;
     return;
 }
 
 void
 avr_thread_join(struct avr_thread *t)
+{
+    avr_thread_join_common(t, 0, 0);
+}
+
+enum avr_thread_wait_result
+avr_thread_join_timed(struct avr_thread *t, uint32_t deadline)
+{
+    return avr_thread_join_common(t, 1, deadline);
+}
+
+static enum avr_thread_wait_result
+avr_thread_join_common(struct avr_thread *t, uint8_t timed,
+                       uint32_t deadline)
 {
     uint8_t         sreg;
-    volatile struct avr_thread *r,
-                   *p;
+    enum avr_thread_wait_result result;
 
     sreg = SREG;
     cli();
@@ -670,147 +1255,257 @@ avr_thread_join(struct avr_thread *t)
      * Returns inmeediately if the target thread is not attachable.
      */
     if (t == NULL || t->state == ats_invalid) {
-        return;
+        SREG = sreg;
+        return awr_ok;
     }
 
-    p = NULL;
-    r = t->next_joined;
-    while (r != NULL) {
-        p = r;
-        r = r->next_joined;
+    /*
+     * A timeout takes the joiner off `t->joiners' there and then, while
+     * `t' is still alive; once `t' stops, all its joiners are off the
+     * queue. Either way, `t' (which may have been freed) is not touched
+     * after the wait.
+     */
+    if (!avr_thread_wait_begin(&t->joiners, ats_joined, timed, deadline)) {
+        SREG = sreg;
+        return awr_timeout;
     }
+    result = avr_thread_wait_end();
 
-    if (p == NULL) {
-        avr_thread_active_thread->next_joined = NULL;
-        t->next_joined = avr_thread_active_thread;
-    } else {
-        avr_thread_active_thread->next_joined = p->next_joined;
-        p->next_joined = avr_thread_active_thread;
-    }
+    SREG = sreg;
+    return result;
+}
 
-    avr_thread_active_thread->state = ats_joined;
-    avr_thread_yield();
+/*
+ * Makes every thread joined to `t' runnable, as `t' stops.
+ *
+ * Must be called with interrupts disabled.
+ */
+static void
+avr_thread_release_joiners(volatile struct avr_thread *t)
+{
+    volatile struct avr_thread *j;
 
-    SREG = sreg;
-    return;
+    while ((j = avr_thread_wait_queue_pop_best(&t->joiners)) != NULL) {
+        j->state = ats_runnable;
+        avr_thread_run_queue_push(j);
+        AVR_THREAD_TRACE(ate_wake, j, 0);
+    }
 }
 
+/*
+ * Appends a thread to the FIFO of its priority level. O(1).
+ */
 static void
 avr_thread_run_queue_push(volatile struct avr_thread *t)
 {
-    volatile struct avr_thread *r;
-
-    for (r = avr_thread_run_queue; r != NULL; r = r->run_queue_next) {
-        if (t->priority > r->priority) {
-            if (r->run_queue_prev != NULL) {
-                t->run_queue_prev = r->run_queue_prev;
-                r->run_queue_prev->run_queue_next = t;
-                r->run_queue_prev = t;
-                t->run_queue_next = r;
-            } else {
-                avr_thread_run_queue = t;
-                t->run_queue_next = r;
-                t->run_queue_prev = NULL;
-                t->run_queue_next->run_queue_prev = t;
-            }
-            return;
-        }
+    uint8_t         prio;
 
-        if (r->run_queue_next == NULL) {
-            r->run_queue_next = t;
-            t->run_queue_next = NULL;
-            t->run_queue_prev = r;
-            return;
-        }
+    if (t == avr_thread_idle_thread) {
+        return;
     }
 
-    avr_thread_run_queue = t;
-    t->run_queue_prev = NULL;
+    prio = t->priority;
     t->run_queue_next = NULL;
+    t->run_queue_prev = avr_thread_run_queue_tail[prio];
+    if (avr_thread_run_queue_tail[prio] != NULL) {
+        avr_thread_run_queue_tail[prio]->run_queue_next = t;
+    } else {
+        avr_thread_run_queue_head[prio] = t;
+        avr_thread_run_queue_bitmap |= (uint8_t) (1 << prio);
+    }
+    avr_thread_run_queue_tail[prio] = t;
+
+    /*
+     * The new thread may preempt the active one or share its quantum,
+     * either of which needs a tick the scheduler may not have asked
+     * for yet.
+     */
+    if (avr_thread_active_thread != NULL &&
+        avr_thread_tick_countdown != 1 &&
+        (avr_thread_active_thread == avr_thread_idle_thread ||
+         prio >= avr_thread_active_thread->priority)) {
+        avr_thread_clock_tick_soon();
+    }
+}
+
+/*
+ * Returns the highest priority level that has a runnable thread.
+ * The run queue must not be empty.
+ */
+static uint8_t
+avr_thread_run_queue_top(void)
+{
+    uint8_t         bitmap;
+
+    bitmap = avr_thread_run_queue_bitmap;
+    if (bitmap & 0xF0) {
+        return 4 + avr_thread_msb_table[bitmap >> 4];
+    }
+    return avr_thread_msb_table[bitmap];
 }
 
+/*
+ * Removes the first thread of the highest non-empty level. O(1).
+ */
 static volatile struct avr_thread *
 avr_thread_run_queue_pop(void)
 {
     volatile struct avr_thread *r;
-
-    if (avr_thread_run_queue != NULL) {
-        r = avr_thread_run_queue;
-        avr_thread_run_queue = r->run_queue_next;
-        if (avr_thread_run_queue != NULL) {
-            avr_thread_run_queue->run_queue_prev = NULL;
-        }
-        r->run_queue_next = NULL;
-        r->run_queue_prev = NULL;
-        return r;
-    }
+    uint8_t         prio;
 
     /*
      * Run the idle thread if the run queue is empty.
      */
-    return avr_thread_idle_thread;
+    if (avr_thread_run_queue_bitmap == 0) {
+        return avr_thread_idle_thread;
+    }
+
+    prio = avr_thread_run_queue_top();
+    r = avr_thread_run_queue_head[prio];
+    avr_thread_run_queue_head[prio] = r->run_queue_next;
+    if (r->run_queue_next != NULL) {
+        r->run_queue_next->run_queue_prev = NULL;
+    } else {
+        avr_thread_run_queue_tail[prio] = NULL;
+        avr_thread_run_queue_bitmap &= (uint8_t) ~(1 << prio);
+    }
+    r->run_queue_next = NULL;
+    r->run_queue_prev = NULL;
+    return r;
 }
 
+/*
+ * Unlinks a thread from the run queue. It is fine to pass a thread that
+ * is not in the run queue. O(1).
+ */
 static void
 avr_thread_run_queue_remove(volatile struct avr_thread *t)
 {
-    volatile struct avr_thread *r;
+    uint8_t         prio;
 
     if (t == NULL) {
         return;
     }
 
-    for (r = avr_thread_run_queue; r != NULL; r = r->run_queue_next) {
-        if (r == t) {
-            if (r->run_queue_prev != NULL) {
-                r->run_queue_prev->run_queue_next = r->run_queue_next;
-            }
+    prio = t->priority;
+    if (t->run_queue_prev == NULL &&
+        avr_thread_run_queue_head[prio] != t) {
+        // Not in the run queue.
+        return;
+    }
 
-            if (r->run_queue_next) {
-                r->run_queue_next->run_queue_prev = r->run_queue_prev;
-            }
-            if (r == avr_thread_run_queue) {
-                avr_thread_run_queue = r->run_queue_next;
-            }
-            r->run_queue_next = NULL;
-            r->run_queue_next = NULL;
-            return;
-        }
+    if (t->run_queue_prev != NULL) {
+        t->run_queue_prev->run_queue_next = t->run_queue_next;
+    } else {
+        avr_thread_run_queue_head[prio] = t->run_queue_next;
+    }
+
+    if (t->run_queue_next != NULL) {
+        t->run_queue_next->run_queue_prev = t->run_queue_prev;
+    } else {
+        avr_thread_run_queue_tail[prio] = t->run_queue_prev;
+    }
+
+    if (avr_thread_run_queue_head[prio] == NULL) {
+        avr_thread_run_queue_bitmap &= (uint8_t) ~(1 << prio);
+    }
+
+    t->run_queue_next = NULL;
+    t->run_queue_prev = NULL;
+}
+
+/*
+ * Links a thread into the wheel slot of its wake-up time. O(1).
+ *
+ * `wake_time' must be later than avr_thread_clock_synced.
+ */
+static void
+avr_thread_sleep_queue_insert(volatile struct avr_thread *t,
+                              uint32_t wake_time)
+{
+    uint8_t         slot;
+
+    slot = (uint8_t) wake_time & (WHEEL_SIZE - 1);
+    t->wake_time = wake_time;
+    t->sleep_queue_prev = NULL;
+    t->sleep_queue_next = avr_thread_wheel[slot];
+    if (t->sleep_queue_next != NULL) {
+        t->sleep_queue_next->sleep_queue_prev = t;
     }
-    // Not found. Implicit return
+    avr_thread_wheel[slot] = t;
+    avr_thread_wheel_bitmap |= 1U << slot;
 }
 
+/*
+ * Unlinks a thread from the wheel. It is fine to pass a thread that is
+ * not sleeping. O(1).
+ */
 static void
 avr_thread_sleep_queue_remove(volatile struct avr_thread *t)
 {
-    volatile struct avr_thread *r,
-                   *p;
+    uint8_t         slot;
 
-    for (p = NULL, r = avr_thread_sleep_queue; r != NULL;
-         p = r, r = r->sleep_queue_next) {
-        if (r == t) {
-            if (t->sleep_queue_next != NULL) {
-                t->sleep_queue_next->sleep_ticks += t->sleep_ticks;
-            }
-            if (avr_thread_sleep_queue == t) {
-                avr_thread_sleep_queue = t->sleep_queue_next;
-            }
-            if (p != NULL) {
-                p->sleep_queue_next = r->sleep_queue_next;
-            }
-            break;
+    if (t == NULL) {
+        return;
+    }
+
+    slot = (uint8_t) t->wake_time & (WHEEL_SIZE - 1);
+    if (t->sleep_queue_prev == NULL && avr_thread_wheel[slot] != t) {
+        // Not sleeping.
+        return;
+    }
+
+    if (t->sleep_queue_prev != NULL) {
+        t->sleep_queue_prev->sleep_queue_next = t->sleep_queue_next;
+    } else {
+        avr_thread_wheel[slot] = t->sleep_queue_next;
+        if (avr_thread_wheel[slot] == NULL) {
+            avr_thread_wheel_bitmap &= ~(1U << slot);
         }
     }
+
+    if (t->sleep_queue_next != NULL) {
+        t->sleep_queue_next->sleep_queue_prev = t->sleep_queue_prev;
+    }
+
+    t->sleep_queue_prev = NULL;
+    t->sleep_queue_next = NULL;
 }
 
-void
-avr_thread_save_sp(uint8_t * sp)
+/*
+ * Wakes up the threads in a slot whose timers ran off by `now'. Those
+ * waiting for a later revolution are left alone.
+ */
+static void
+avr_thread_sleep_queue_expire(uint8_t slot, uint32_t now)
 {
-    /*
-     * Do you see why?
-     */
-    sp += 2;
-    avr_thread_prev_thread->sp = sp;
+    volatile struct avr_thread *t,
+                   *n;
+
+    for (t = avr_thread_wheel[slot]; t != NULL; t = n) {
+        n = t->sleep_queue_next;
+        if ((int32_t) (t->wake_time - now) > 0) {
+            continue;
+        }
+        avr_thread_sleep_queue_remove(t);
+
+        /*
+         * A thread in a wait with a deadline is on a wait queue (or a
+         * join list) and on the wheel at the same time. If it has already
+         * been woken up by what it waited for, the timer is just stale.
+         */
+        if (t->state == ats_waiting || t->state == ats_joined) {
+            t->wait_result = awr_timeout;
+            if (t->waiting_in != NULL) {
+                avr_thread_wait_queue_remove(t->waiting_in, t);
+            }
+        } else if (t->state != ats_sleeping) {
+            continue;
+        }
+        t->state = ats_runnable;
+        avr_thread_run_queue_push(t);
+        AVR_THREAD_TRACE(ate_wake, t, 0);
+    }
 }
 
 /**
@@ -818,6 +1513,7 @@ avr_thread_save_sp(uint8_t * sp)
  * =====
  */
 
+#ifndef NO_HEAP
 struct avr_thread_mutex *
 avr_thread_mutex_init(void)
 {
@@ -827,10 +1523,8 @@ avr_thread_mutex_init(void)
     if (mutex == NULL) {
         return NULL;
     }
-    mutex->locked = 0;
-    mutex->wait_queue = NULL;
 
-    return mutex;
+    return avr_thread_mutex_init_static(mutex);
 }
 
 void
@@ -845,67 +1539,95 @@ avr_thread_mutex_destory(volatile struct avr_thread_mutex *mutex)
         free(mutex);
     }
 
-    sreg = SREG;
+    SREG = sreg;
     return;
 }
+#endif
+
+struct avr_thread_mutex *
+avr_thread_mutex_init_static(struct avr_thread_mutex *mutex)
+{
+    if (mutex == NULL) {
+        return NULL;
+    }
+    mutex->locked = 0;
+    mutex->wait_queue.head = NULL;
+    mutex->wait_queue.tail = NULL;
+    mutex->owner = NULL;
+    mutex->next_held = NULL;
+
+    return mutex;
+}
 
 void
 avr_thread_mutex_lock(volatile struct avr_thread_mutex *mutex)
+{
+    avr_thread_mutex_lock_common(mutex, 0, 0);
+}
+
+enum avr_thread_wait_result
+avr_thread_mutex_lock_timed(volatile struct avr_thread_mutex *mutex,
+                            uint32_t deadline)
+{
+    return avr_thread_mutex_lock_common(mutex, 1, deadline);
+}
+
+static enum avr_thread_wait_result
+avr_thread_mutex_lock_common(volatile struct avr_thread_mutex *mutex,
+                             uint8_t timed, uint32_t deadline)
 {
     uint8_t         sreg;
-    volatile struct avr_thread *t,
-                   *p;
+    enum avr_thread_wait_result result;
 
     if (mutex == NULL) {
-        return;
+        return awr_ok;
     }
 
-    while (1) {
-        sreg = SREG;
-        cli();
+    sreg = SREG;
+    cli();
 
-        if (mutex->locked == 0) {
-            mutex->locked = 1;
+    if (mutex->locked == 0) {
+        mutex->locked = 1;
+        mutex->owner = avr_thread_active_thread;
+        mutex->next_held = avr_thread_active_thread->held_mutexes;
+        avr_thread_active_thread->held_mutexes = mutex;
 #ifdef SANITY
-            avr_thread_active_thread->owning = mutex;
+        avr_thread_active_thread->owning = mutex;
 #endif
-            SREG = sreg;
-            return;
-        } else {
-            /**
-             * //Or, you can do busy waiting here.
-             *
-             * SREG = sreg;
-             * avr_thread_yield();
-             * continue;
-             *
-             */
+        AVR_THREAD_TRACE(ate_lock, avr_thread_active_thread,
+                         (uint8_t) (uintptr_t) mutex);
+        SREG = sreg;
+        return awr_ok;
+    }
 
-            t = mutex->wait_queue;
-            p = NULL;
-            while (t != NULL) {
-                p = t;
-                t = t->wait_queue_next;
-            }
-            if (p == NULL) {
-                mutex->wait_queue = avr_thread_active_thread;
-                mutex->wait_queue->wait_queue_next = NULL;
-            } else {
-                avr_thread_active_thread->wait_queue_next =
-                    p->wait_queue_next;
-                p->wait_queue_next = avr_thread_active_thread;
-            }
-            avr_thread_active_thread->state = ats_waiting;
+    /*
+     * Wait in line. The unlocking thread hands the mutex straight to
+     * the waiter it picks, so once we run again the mutex is ours,
+     * unless the deadline came first.
+     */
+    if (!avr_thread_wait_begin(&mutex->wait_queue, ats_waiting, timed,
+                               deadline)) {
+        SREG = sreg;
+        return awr_timeout;
+    }
+    avr_thread_active_thread->blocked_on = mutex;
+    avr_thread_mutex_inherit(mutex);
 
-            SREG = sreg;
-            avr_thread_yield();
-        }
+    result = avr_thread_wait_end();
+    if (result == awr_timeout) {
+        avr_thread_active_thread->blocked_on = NULL;
+        avr_thread_mutex_reinherit(mutex);
     }
+
+    SREG = sreg;
+    return result;
 }
 
 void
 avr_thread_mutex_unlock(volatile struct avr_thread_mutex *mutex)
 {
+    volatile struct avr_thread *t,
+                   *w;
     uint8_t         sreg = SREG;
     cli();
 
@@ -915,8 +1637,6 @@ avr_thread_mutex_unlock(volatile struct avr_thread_mutex *mutex)
     }
 
     if (mutex != NULL && mutex->locked == 1) {
-        mutex->locked = 0;
-
 #ifdef SANITY
         /*
          * I assume the thread releases the mutex is the one owning the
@@ -925,252 +1645,1506 @@ avr_thread_mutex_unlock(volatile struct avr_thread_mutex *mutex)
         avr_thread_active_thread->owning = NULL;
 #endif
 
-        while (mutex->wait_queue != NULL) {
-            mutex->wait_queue->state = ats_runnable;
-            avr_thread_run_queue_push(mutex->wait_queue);
-            mutex->wait_queue = mutex->wait_queue->wait_queue_next;
+        t = mutex->owner;
+        AVR_THREAD_TRACE(ate_unlock, t, (uint8_t) (uintptr_t) mutex);
+
+        /*
+         * Hand the mutex over to the most important waiter, or the one
+         * that has waited longest among equals. Waking up everybody to
+         * let only one of them in is a waste of context switches.
+         */
+        w = avr_thread_wait_queue_pop_best(&mutex->wait_queue);
+        avr_thread_mutex_disinherit(t, mutex);
+        if (w != NULL) {
+            mutex->owner = w;
+            mutex->next_held = w->held_mutexes;
+            w->held_mutexes = mutex;
+            w->blocked_on = NULL;
+#ifdef SANITY
+            w->owning = mutex;
+#endif
+            w->state = ats_runnable;
+            avr_thread_run_queue_push(w);
+            AVR_THREAD_TRACE(ate_lock, w, (uint8_t) (uintptr_t) mutex);
+            AVR_THREAD_TRACE(ate_wake, w, 0);
+        } else {
+            mutex->locked = 0;
+            mutex->owner = NULL;
+        }
+
+        /*
+         * If the owner was running on a borrowed priority, whoever lent
+         * it should run now.
+         */
+        if (avr_thread_run_queue_bitmap != 0 &&
+            avr_thread_run_queue_top() >
+            avr_thread_active_thread->priority) {
+            avr_thread_yield();
         }
     }
 
-    /*
-     * You may do an avr_thread_yield() here.
-     */
+    SREG = sreg;
     return;
 }
 
-/**
- * Semaphore
- * =========
+/*
+ * Inserts a thread into a wait queue behind every waiter at least as
+ * important. O(1) when it is the least important one, as when all
+ * waiters have the same priority.
  */
-
-struct avr_thread_semaphore *
-avr_thread_semaphore_init(int value)
+static void
+avr_thread_wait_queue_push(volatile struct avr_thread_wait_queue *q,
+                           volatile struct avr_thread *t)
 {
-    struct avr_thread_semaphore *sem;
+    volatile struct avr_thread *prev;
 
-    if (value < 0) {
-        return NULL;
+    prev = q->tail;
+    while (prev != NULL && prev->priority < t->priority) {
+        prev = prev->wait_queue_prev;
     }
 
-    sem = malloc(sizeof(struct avr_thread_semaphore));
-    if (sem == NULL) {
-        return NULL;
+    t->waiting_in = q;
+    t->wait_queue_prev = prev;
+    if (prev != NULL) {
+        t->wait_queue_next = prev->wait_queue_next;
+        prev->wait_queue_next = t;
+    } else {
+        t->wait_queue_next = q->head;
+        q->head = t;
     }
-    sem->lock_count = value;
-    sem->mutex = avr_thread_mutex_init();
-    if (sem->mutex == NULL) {
-        return NULL;
+    if (t->wait_queue_next != NULL) {
+        t->wait_queue_next->wait_queue_prev = t;
+    } else {
+        q->tail = t;
     }
-    sem->wait_queue = NULL;
+}
 
-    return sem;
+/*
+ * Unlinks a thread from the wait queue it is in. O(1).
+ */
+static void
+avr_thread_wait_queue_remove(volatile struct avr_thread_wait_queue *q,
+                             volatile struct avr_thread *t)
+{
+    if (t->wait_queue_prev != NULL) {
+        t->wait_queue_prev->wait_queue_next = t->wait_queue_next;
+    } else {
+        q->head = t->wait_queue_next;
+    }
+    if (t->wait_queue_next != NULL) {
+        t->wait_queue_next->wait_queue_prev = t->wait_queue_prev;
+    } else {
+        q->tail = t->wait_queue_prev;
+    }
+    t->wait_queue_prev = NULL;
+    t->wait_queue_next = NULL;
+    t->waiting_in = NULL;
 }
 
-/**
- * Consider what will happen if one thread does down() and then destory
- * the semaphore?
+/*
+ * Unlinks and returns the waiter with the highest priority, which the
+ * queue keeps at its head; the one that came first if there is a tie.
+ * Returns NULL if nobody waits. O(1).
+ */
+static volatile struct avr_thread *
+avr_thread_wait_queue_pop_best(volatile struct avr_thread_wait_queue *q)
+{
+    volatile struct avr_thread *best;
+
+    best = q->head;
+    if (best != NULL) {
+        avr_thread_wait_queue_remove(q, best);
+    }
+    return best;
+}
+
+/*
+ * Makes the most important thread waiting in `q' runnable, if any.
+ * Returns 1 if it is more important than the active one.
  *
- * It would be _your_ fault if you call this function twice on a same
- * semaphore.
+ * Must be called with interrupts disabled.
  */
-void
-avr_thread_semaphore_destroy(volatile struct avr_thread_semaphore
-                             *sem)
+static uint8_t
+avr_thread_wait_queue_wake(volatile struct avr_thread_wait_queue *q)
 {
-    uint8_t         sreg;
-    sreg = SREG;
-    cli();
-    if (sem != NULL) {
-        if (sem->mutex != NULL) {
-            avr_thread_mutex_destory(sem->mutex);
-            sem->mutex = NULL;  /* This will work. */
+    volatile struct avr_thread *t;
+
+    t = avr_thread_wait_queue_pop_best(q);
+    if (t == NULL) {
+        return 0;
+    }
+    t->state = ats_runnable;
+    avr_thread_run_queue_push(t);
+    AVR_THREAD_TRACE(ate_wake, t, 0);
+
+    return t->priority > avr_thread_active_thread->priority;
+}
+
+/*
+ * Blocks the active thread in `q' (unless NULL) with `state' and, if
+ * `timed', arms its timer for `deadline' as well: whichever comes first
+ * wakes it up. Returns 0, having done nothing, if the deadline has
+ * already passed.
+ *
+ * The thread keeps running until avr_thread_wait_end() (or anything else
+ * that yields), so the caller can still release what it holds.
+ *
+ * Must be called with interrupts disabled.
+ */
+static uint8_t
+avr_thread_wait_begin(volatile struct avr_thread_wait_queue *q,
+                      enum avr_thread_state state, uint8_t timed,
+                      uint32_t deadline)
+{
+    volatile struct avr_thread *t;
+
+    t = avr_thread_active_thread;
+    if (timed) {
+        avr_thread_clock_sync();
+        if ((int32_t) (deadline - avr_thread_clock_synced) <= 0) {
+            return 0;
         }
-        free(sem);
-        // sem = NULL; /* This will not work */
+        avr_thread_sleep_queue_insert(t, deadline);
     }
-    SREG = sreg;
-    return;
+    if (q != NULL) {
+        avr_thread_wait_queue_push(q, t);
+    }
+    t->wait_result = awr_ok;
+    t->state = state;
+    return 1;
 }
 
-void
-avr_thread_sem_up(volatile struct avr_thread_semaphore *sem)
+/*
+ * Yields until the wait set up by avr_thread_wait_begin() is over, unless
+ * it is over already. On awr_timeout the thread is off its wait queue.
+ *
+ * Must be called with interrupts disabled.
+ */
+static enum avr_thread_wait_result
+avr_thread_wait_end(void)
 {
-    if (sem == NULL || sem->mutex == NULL) {
-        return;
+    volatile struct avr_thread *t;
+
+    t = avr_thread_active_thread;
+    if (t->state != ats_runnable) {
+        avr_thread_yield();
     }
-    avr_thread_mutex_lock(sem->mutex);
-    ++(sem->lock_count);
+
     /*
-     * Since we have only up() once, we only need to wake up one
-     * waiting thread.
+     * Woken up before the deadline: the timer is still armed.
      */
-    if (sem->wait_queue != NULL) {
-        sem->wait_queue->state = ats_runnable;
-        avr_thread_run_queue_push(sem->wait_queue);
-        sem->wait_queue = sem->wait_queue->wait_queue_next;
-    }
-
-    avr_thread_mutex_unlock(sem->mutex);
+    avr_thread_sleep_queue_remove(t);
+    return t->wait_result;
 }
 
-void
-avr_thread_sem_down(volatile struct avr_thread_semaphore *sem)
+/*
+ * Flags `t' if the byte STACK_MARGIN bytes above the bottom of its stack
+ * has ever been written. It only looks at one byte, so it is cheap enough
+ * to run on every context switch. A thread that skips over the byte
+ * (e.g., with a large local array it never fully uses) is not caught.
+ *
+ * Must be called with interrupts disabled.
+ */
+static void
+avr_thread_stack_check(volatile struct avr_thread *t)
 {
-    volatile struct avr_thread *t,
-                   *p;
-    if (sem == NULL || sem->mutex == NULL) {
-        /*
-         * Return error messages.
-         */
+    uint16_t        margin;
+
+    if (t->stack == NULL) {
         return;
     }
+    margin = STACK_MARGIN;
+    if (margin >= t->stack_size) {
+        margin = t->stack_size - 1;
+    }
+    if (t->stack[margin] != STACK_PAINT) {
+        t->flags |= ATF_STACK_LOW;
+    }
+}
 
-    /*
-     * We do not need to cei() here because the reading/writing to the
-     * value of semaphore are protected by its mutex.
-     */
+uint16_t
+avr_thread_stack_unused(struct avr_thread *t)
+{
+    uint16_t        n;
 
     /*
-     * The flow is:
-     *
-     * acquire the mutex -> check the value of the semaphore ->
-     *
-     * a. if the value is 0, release the mutex (so that other threads
-     * can acquire the mutex and change the value) -> loop.
-     *
-     * b. otherwise, decrement the value (this opearting is safe as we
-     * are holding the mutex -> release the mutex -> return
+     * No need to disable interrupts: the painted bytes are below the
+     * stack pointer of `t', and they only ever turn into something else.
      */
-    while (1) {
-        avr_thread_mutex_lock(sem->mutex);
-        if (sem->lock_count == 0) {
-            t = sem->wait_queue;
-            p = NULL;
-            while (t != NULL) {
-                p = t;
-                t = t->wait_queue_next;
-            }
-            if (p == NULL) {
-                sem->wait_queue = avr_thread_active_thread;
-                avr_thread_active_thread->wait_queue_next = NULL;
-            } else {
-                avr_thread_active_thread->wait_queue_next =
-                    p->wait_queue_next;
-                p->wait_queue_next = avr_thread_active_thread;
-            }
-            avr_thread_mutex_unlock(sem->mutex);
-            avr_thread_active_thread->state = ats_waiting;
-            avr_thread_yield();
-        } else {
-            --(sem->lock_count);
-            avr_thread_mutex_unlock(sem->mutex);
-            return;
-        }
+    n = 0;
+    while (t->stack != NULL && n < t->stack_size &&
+           t->stack[n] == STACK_PAINT) {
+        ++n;
     }
+    return n;
 }
 
-/**
- * Readers-writer lock
- * ===================
- */
-
-/*
- * The following implementation was adapted from Google's Go programming
- * language.
- */
+uint8_t
+avr_thread_stack_low(struct avr_thread *t)
+{
+    return (t->flags & ATF_STACK_LOW) != 0;
+}
 
+#ifdef TRACE
 /*
- * Simulates the atomic addition operation on other architecture.
+ * Appends a record to the trace buffer. If the buffer is full, the record
+ * is dropped and counted; the count is recorded as soon as there is room
+ * again, so that the reader knows where the gap is.
+ *
+ * Must be called with interrupts disabled.
  */
-static          int8_t
-avr_thread_atomic_add(int8_t x, int8_t delta)
+static void
+avr_thread_trace_record(uint8_t event, volatile struct avr_thread *t,
+                        uint8_t arg)
 {
+    volatile struct avr_thread_trace_record *r;
+    uint8_t         tail,
+                    free_slots,
+                    tcnt;
+    uint16_t        ms;
+
+    tail = avr_thread_trace_tail;
+    free_slots = (avr_thread_trace_head - tail - 1) & (TRACE_SIZE - 1);
+    if (free_slots < (avr_thread_trace_lost != 0 ? 2 : 1)) {
+        if (avr_thread_trace_lost != 0xff) {
+            ++avr_thread_trace_lost;
+        }
+        return;
+    }
+
+    /*
+     * With interrupts disabled, the counter may have wrapped without the
+     * clock having been bumped yet.
+     */
+    ms = (uint16_t) avr_thread_clock;
+    tcnt = TCNT0;
+    if ((TIFR0 & (1 << OCF0A)) && tcnt < OCR0A / 2) {
+        ++ms;
+    }
 
-    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-        x += delta;
+    if (avr_thread_trace_lost != 0) {
+        r = &avr_thread_trace_ring[tail];
+        r->event = ate_lost;
+        r->thread = t->id;
+        r->arg = avr_thread_trace_lost;
+        r->tcnt = tcnt;
+        r->ms = ms;
+        tail = (tail + 1) & (TRACE_SIZE - 1);
+        avr_thread_trace_lost = 0;
     }
-    return x;
+
+    r = &avr_thread_trace_ring[tail];
+    r->event = event;
+    r->thread = t->id;
+    r->arg = arg;
+    r->tcnt = tcnt;
+    r->ms = ms;
+    avr_thread_trace_tail = (tail + 1) & (TRACE_SIZE - 1);
 }
 
-struct avr_thread_rwlock *
-avr_thread_rwlock_init(void)
+uint8_t
+avr_thread_trace_read(struct avr_thread_trace_record *r)
 {
-    struct avr_thread_rwlock *r;
-    r = malloc(sizeof(struct avr_thread_rwlock));
-    if (r == NULL) {
-        return NULL;
+    uint8_t         sreg;
+    uint8_t         head;
+
+    sreg = SREG;
+    cli();
+
+    head = avr_thread_trace_head;
+    if (head == avr_thread_trace_tail) {
+        SREG = sreg;
+        return 0;
     }
-    r->mutex = avr_thread_mutex_init();
-    r->writer_sem = avr_thread_semaphore_init(0);
-    r->reader_sem = avr_thread_semaphore_init(0);
-    r->num_reader = 0;
-    r->num_waiting_reader = 0;
-    return r;
+    *r = avr_thread_trace_ring[head];
+    avr_thread_trace_head = (head + 1) & (TRACE_SIZE - 1);
+
+    SREG = sreg;
+    return 1;
 }
+#endif
 
-void
-avr_thread_rwlock_destroy(volatile struct avr_thread_rwlock *rwlock)
+/*
+ * Changes the effective priority of a thread, keeping it at the right
+ * place in the run queue or in the wait queue it blocks in.
+ *
+ * Must be called with interrupts disabled.
+ */
+static void
+avr_thread_set_priority(volatile struct avr_thread *t,
+                        enum avr_thread_priority priority)
 {
-    if (rwlock == NULL) {
+    volatile struct avr_thread *r;
+    volatile struct avr_thread_wait_queue *q;
+
+    if (t->priority == priority) {
         return;
     }
-    avr_thread_mutex_destory(rwlock->mutex);
-    avr_thread_semaphore_destroy(rwlock->writer_sem);
-    avr_thread_semaphore_destroy(rwlock->reader_sem);
-    free(rwlock);
+
+    if (t->state == ats_runnable && t != avr_thread_active_thread) {
+        avr_thread_run_queue_remove(t);
+        t->priority = priority;
+        avr_thread_run_queue_push(t);
+    } else if (t->waiting_in != NULL) {
+        q = t->waiting_in;
+        avr_thread_wait_queue_remove(q, t);
+        t->priority = priority;
+        avr_thread_wait_queue_push(q, t);
+    } else {
+        t->priority = priority;
+    }
+
+    /*
+     * A lower priority may let another thread preempt the active one.
+     */
+    r = avr_thread_active_thread;
+    if (t == r && avr_thread_run_queue_bitmap != 0 &&
+        avr_thread_run_queue_top() > r->priority) {
+        avr_thread_clock_tick_soon();
+    }
 }
 
-void
-avr_thread_rwlock_rdlock(volatile struct avr_thread_rwlock *rwlock)
+/*
+ * The active thread is about to wait for `mutex'. Lends its priority to
+ * the owner of the mutex, and on down the chain if that owner is itself
+ * waiting for another mutex.
+ *
+ * Must be called with interrupts disabled.
+ */
+static void
+avr_thread_mutex_inherit(volatile struct avr_thread_mutex *mutex)
 {
-    if (rwlock == NULL) {
-        return;
-    }
-    if (avr_thread_atomic_add(rwlock->num_reader, 1) < 0) {
-        avr_thread_sem_down(rwlock->reader_sem);
+    volatile struct avr_thread *t;
+    enum avr_thread_priority priority;
+
+    priority = avr_thread_active_thread->priority;
+    t = mutex->owner;
+    while (t != NULL && t->priority < priority) {
+        avr_thread_set_priority(t, priority);
+        if (t->state != ats_waiting || t->blocked_on == NULL) {
+            break;
+        }
+        t = t->blocked_on->owner;
     }
 }
 
-void
-avr_thread_rwlock_rdunlock(volatile struct avr_thread_rwlock *rwlock)
+/*
+ * `t' has just released `mutex'. Drops the mutex from its records and
+ * works out its priority again: its own, or that of the most important
+ * thread waiting for a mutex it still holds, whichever is higher.
+ *
+ * Must be called with interrupts disabled.
+ */
+static void
+avr_thread_mutex_disinherit(volatile struct avr_thread *t,
+                            volatile struct avr_thread_mutex *mutex)
 {
-    if (rwlock == NULL) {
+    volatile struct avr_thread_mutex *m,
+                   *p;
+    volatile struct avr_thread *w;
+    enum avr_thread_priority priority;
+
+    if (t == NULL) {
         return;
     }
-    if (avr_thread_atomic_add(rwlock->num_reader, -1) < 0) {
-        if (avr_thread_atomic_add(rwlock->num_waiting_reader, -1) ==
-            0) {
-            avr_thread_sem_up(rwlock->writer_sem);
+
+    priority = t->base_priority;
+    for (p = NULL, m = t->held_mutexes; m != NULL;) {
+        if (m == mutex) {
+            if (p == NULL) {
+                t->held_mutexes = m->next_held;
+            } else {
+                p->next_held = m->next_held;
+            }
+            m = m->next_held;
+            continue;
+        }
+        for (w = m->wait_queue.head; w != NULL; w = w->wait_queue_next) {
+            if (w->priority > priority) {
+                priority = w->priority;
+            }
         }
+        p = m;
+        m = m->next_held;
     }
+
+    avr_thread_set_priority(t, priority);
 }
 
-void
-avr_thread_rwlock_wrlock(volatile struct avr_thread_rwlock *rwlock)
+/*
+ * A waiter has given up on `mutex'. Works out again the priority of its
+ * owner, and of the owners down the chain the owner is blocked on, which
+ * may have been running on the waiter's priority.
+ *
+ * Must be called with interrupts disabled.
+ */
+static void
+avr_thread_mutex_reinherit(volatile struct avr_thread_mutex *mutex)
 {
-    int8_t          r;
-
-    avr_thread_mutex_lock(rwlock->mutex);
+    volatile struct avr_thread *t;
 
-    r = avr_thread_atomic_add(rwlock->num_reader, -MAX_READER) +
-        MAX_READER;
-    if (r != 0
-        && avr_thread_atomic_add(rwlock->num_waiting_reader,
-                                 r) != 0) {
-        avr_thread_sem_down(rwlock->writer_sem);
+    for (t = mutex->owner; t != NULL; t = t->blocked_on->owner) {
+        avr_thread_mutex_disinherit(t, NULL);
+        if (t->state != ats_waiting || t->blocked_on == NULL) {
+            break;
+        }
     }
 }
 
-void
-avr_thread_rwlock_wrunlock(volatile struct avr_thread_rwlock *rwlock)
+/**
+ * Semaphore
+ * =========
+ */
+
+#ifndef NO_HEAP
+struct avr_thread_semaphore *
+avr_thread_semaphore_init(int value)
 {
-    int8_t          r,
-                    i;
+    struct avr_thread_semaphore *sem;
+
+    if (value < 0) {
+        return NULL;
+    }
 
-    r = avr_thread_atomic_add(rwlock->num_reader, MAX_READER);
-    for (i = 0; i < r; ++i) {
-        avr_thread_sem_down(rwlock->reader_sem);
+    sem = malloc(sizeof(struct avr_thread_semaphore));
+    if (sem == NULL) {
+        return NULL;
     }
 
-    avr_thread_mutex_unlock(rwlock->mutex);
+    return avr_thread_semaphore_init_static(sem, value);
+}
+
+/**
+ * Consider what will happen if one thread does down() and then destory
+ * the semaphore?
+ *
+ * It would be _your_ fault if you call this function twice on a same
+ * semaphore.
+ */
+void
+avr_thread_semaphore_destroy(volatile struct avr_thread_semaphore
+                             *sem)
+{
+    uint8_t         sreg;
+    sreg = SREG;
+    cli();
+    if (sem != NULL) {
+        free(sem);
+        // sem = NULL; /* This will not work */
+    }
+    SREG = sreg;
+    return;
+}
+#endif
+
+struct avr_thread_semaphore *
+avr_thread_semaphore_init_static(struct avr_thread_semaphore *sem,
+                                 int value)
+{
+    if (sem == NULL || value < 0) {
+        return NULL;
+    }
+
+    sem->lock_count = value;
+    sem->wait_queue.head = NULL;
+    sem->wait_queue.tail = NULL;
+
+    return sem;
+}
+
+/*
+ * Gives a unit to the most important waiter, or adds it to the value if
+ * nobody waits. Returns 1 if the woken waiter is more important than the
+ * active thread.
+ *
+ * Must be called with interrupts disabled.
+ */
+static uint8_t
+avr_thread_sem_post(volatile struct avr_thread_semaphore *sem)
+{
+    if (sem->wait_queue.head == NULL) {
+        ++(sem->lock_count);
+        return 0;
+    }
+    return avr_thread_wait_queue_wake(&sem->wait_queue);
+}
+
+void
+avr_thread_sem_up(volatile struct avr_thread_semaphore *sem)
+{
+    uint8_t         sreg;
+
+    if (sem == NULL) {
+        return;
+    }
+
+    sreg = SREG;
+    cli();
+
+    if (avr_thread_sem_post(sem)) {
+        avr_thread_yield();
+    }
+
+    SREG = sreg;
+}
+
+void
+avr_thread_sem_post_from_isr(volatile struct avr_thread_semaphore *sem)
+{
+    uint8_t         sreg;
+
+    if (sem == NULL) {
+        return;
+    }
+
+    sreg = SREG;
+    cli();
+
+    /*
+     * Pushing the waiter to the run queue asks for a tick if it may
+     * preempt the interrupted thread.
+     */
+    avr_thread_sem_post(sem);
+
+    SREG = sreg;
+}
+
+void
+avr_thread_sem_down(volatile struct avr_thread_semaphore *sem)
+{
+    avr_thread_sem_down_common(sem, 0, 0);
+}
+
+enum avr_thread_wait_result
+avr_thread_sem_down_timed(volatile struct avr_thread_semaphore *sem,
+                          uint32_t deadline)
+{
+    return avr_thread_sem_down_common(sem, 1, deadline);
+}
+
+static enum avr_thread_wait_result
+avr_thread_sem_down_common(volatile struct avr_thread_semaphore *sem,
+                           uint8_t timed, uint32_t deadline)
+{
+    uint8_t         sreg;
+    enum avr_thread_wait_result result;
+
+    if (sem == NULL) {
+        /*
+         * Return error messages.
+         */
+        return awr_ok;
+    }
+
+    sreg = SREG;
+    cli();
+
+    if (sem->lock_count != 0) {
+        --(sem->lock_count);
+        SREG = sreg;
+        return awr_ok;
+    }
+
+    /*
+     * An up() hands its unit over to us directly, so once we are woken
+     * up in time there is nothing left to check.
+     */
+    if (!avr_thread_wait_begin(&sem->wait_queue, ats_waiting, timed,
+                               deadline)) {
+        SREG = sreg;
+        return awr_timeout;
+    }
+    result = avr_thread_wait_end();
+
+    SREG = sreg;
+    return result;
+}
+
+/**
+ * Readers-writer lock
+ * ===================
+ */
+
+#ifndef NO_HEAP
+struct avr_thread_rwlock *
+avr_thread_rwlock_init(void)
+{
+    struct avr_thread_rwlock *r;
+    r = malloc(sizeof(struct avr_thread_rwlock));
+    if (r == NULL) {
+        return NULL;
+    }
+    return avr_thread_rwlock_init_static(r);
+}
+
+void
+avr_thread_rwlock_destroy(volatile struct avr_thread_rwlock *rwlock)
+{
+    if (rwlock == NULL) {
+        return;
+    }
+    free(rwlock);
+}
+#endif
+
+struct avr_thread_rwlock *
+avr_thread_rwlock_init_static(struct avr_thread_rwlock *r)
+{
+    if (r == NULL) {
+        return NULL;
+    }
+    r->state = 0;
+    r->readers.head = NULL;
+    r->readers.tail = NULL;
+    r->writers.head = NULL;
+    r->writers.tail = NULL;
+    return r;
+}
+
+/*
+ * Lets in every waiting reader, if no writer holds or wants the lock.
+ * Like mutexes, the lock is handed over: woken readers already hold it.
+ *
+ * Must be called with interrupts disabled.
+ */
+static void
+avr_thread_rwlock_grant_readers(volatile struct avr_thread_rwlock *rwlock)
+{
+    volatile struct avr_thread *t;
+
+    if (rwlock->state == RWLOCK_WRITER || rwlock->writers.head != NULL) {
+        return;
+    }
+    while (rwlock->state < RWLOCK_WRITER - 1 &&
+           (t = rwlock->readers.head) != NULL) {
+        avr_thread_wait_queue_remove(&rwlock->readers, t);
+        ++rwlock->state;
+        t->state = ats_runnable;
+        avr_thread_run_queue_push(t);
+        AVR_THREAD_TRACE(ate_wake, t, 0);
+    }
+}
+
+/*
+ * Hands the free lock to the most important waiting writer, or else to
+ * the waiting readers. Yields if one of them is more important than the
+ * caller.
+ *
+ * Must be called with interrupts disabled.
+ */
+static void
+avr_thread_rwlock_release(volatile struct avr_thread_rwlock *rwlock)
+{
+    volatile struct avr_thread *t;
+
+    t = avr_thread_wait_queue_pop_best(&rwlock->writers);
+    if (t != NULL) {
+        rwlock->state = RWLOCK_WRITER;
+        t->state = ats_runnable;
+        avr_thread_run_queue_push(t);
+        AVR_THREAD_TRACE(ate_wake, t, 0);
+    } else {
+        avr_thread_rwlock_grant_readers(rwlock);
+    }
+
+    if (avr_thread_run_queue_bitmap != 0 &&
+        avr_thread_run_queue_top() > avr_thread_active_thread->priority) {
+        avr_thread_yield();
+    }
+}
+
+static enum avr_thread_wait_result
+avr_thread_rwlock_rdlock_common(volatile struct avr_thread_rwlock *rwlock,
+                                uint8_t timed, uint32_t deadline)
+{
+    uint8_t         sreg;
+    enum avr_thread_wait_result result;
+
+    if (rwlock == NULL) {
+        return awr_ok;
+    }
+
+    sreg = SREG;
+    cli();
+
+    if (rwlock->state < RWLOCK_WRITER - 1 && rwlock->writers.head == NULL) {
+        ++rwlock->state;
+        SREG = sreg;
+        return awr_ok;
+    }
+
+    if (!avr_thread_wait_begin(&rwlock->readers, ats_waiting, timed,
+                               deadline)) {
+        SREG = sreg;
+        return awr_timeout;
+    }
+    result = avr_thread_wait_end();
+
+    SREG = sreg;
+    return result;
+}
+
+static enum avr_thread_wait_result
+avr_thread_rwlock_wrlock_common(volatile struct avr_thread_rwlock *rwlock,
+                                uint8_t timed, uint32_t deadline)
+{
+    uint8_t         sreg;
+    enum avr_thread_wait_result result;
+
+    if (rwlock == NULL) {
+        return awr_ok;
+    }
+
+    sreg = SREG;
+    cli();
+
+    if (rwlock->state == 0) {
+        rwlock->state = RWLOCK_WRITER;
+        SREG = sreg;
+        return awr_ok;
+    }
+
+    if (!avr_thread_wait_begin(&rwlock->writers, ats_waiting, timed,
+                               deadline)) {
+        SREG = sreg;
+        return awr_timeout;
+    }
+    result = avr_thread_wait_end();
+
+    /*
+     * The readers held back for us may go in now, unless another writer
+     * is waiting.
+     */
+    if (result == awr_timeout) {
+        avr_thread_rwlock_grant_readers(rwlock);
+    }
+
+    SREG = sreg;
+    return result;
+}
+
+void
+avr_thread_rwlock_rdlock(volatile struct avr_thread_rwlock *rwlock)
+{
+    avr_thread_rwlock_rdlock_common(rwlock, 0, 0);
+}
+
+enum avr_thread_wait_result
+avr_thread_rwlock_rdlock_timed(volatile struct avr_thread_rwlock *rwlock,
+                               uint32_t deadline)
+{
+    return avr_thread_rwlock_rdlock_common(rwlock, 1, deadline);
+}
+
+void
+avr_thread_rwlock_rdunlock(volatile struct avr_thread_rwlock *rwlock)
+{
+    uint8_t         sreg;
+
+    if (rwlock == NULL) {
+        return;
+    }
+
+    sreg = SREG;
+    cli();
+
+    if (rwlock->state != 0 && rwlock->state != RWLOCK_WRITER &&
+        --rwlock->state == 0) {
+        avr_thread_rwlock_release(rwlock);
+    }
+
+    SREG = sreg;
+}
+
+void
+avr_thread_rwlock_wrlock(volatile struct avr_thread_rwlock *rwlock)
+{
+    avr_thread_rwlock_wrlock_common(rwlock, 0, 0);
+}
+
+enum avr_thread_wait_result
+avr_thread_rwlock_wrlock_timed(volatile struct avr_thread_rwlock *rwlock,
+                               uint32_t deadline)
+{
+    return avr_thread_rwlock_wrlock_common(rwlock, 1, deadline);
+}
+
+void
+avr_thread_rwlock_wrunlock(volatile struct avr_thread_rwlock *rwlock)
+{
+    uint8_t         sreg;
+
+    if (rwlock == NULL) {
+        return;
+    }
+
+    sreg = SREG;
+    cli();
+
+    if (rwlock->state == RWLOCK_WRITER) {
+        rwlock->state = 0;
+        avr_thread_rwlock_release(rwlock);
+    }
+
+    SREG = sreg;
+}
+
+/**
+ * Event flags
+ * ===========
+ */
+
+#ifndef NO_HEAP
+struct avr_thread_event *
+avr_thread_event_init(void)
+{
+    struct avr_thread_event *event;
+
+    event = malloc(sizeof(struct avr_thread_event));
+    if (event == NULL) {
+        return NULL;
+    }
+
+    return avr_thread_event_init_static(event);
+}
+
+void
+avr_thread_event_destroy(volatile struct avr_thread_event *event)
+{
+    uint8_t         sreg;
+
+    sreg = SREG;
+    cli();
+
+    if (event != NULL) {
+        free(event);
+    }
+
+    SREG = sreg;
+}
+#endif
+
+struct avr_thread_event *
+avr_thread_event_init_static(struct avr_thread_event *event)
+{
+    if (event == NULL) {
+        return NULL;
+    }
+    event->bits = 0;
+    event->wait_queue.head = NULL;
+    event->wait_queue.tail = NULL;
+
+    return event;
+}
+
+uint8_t
+avr_thread_event_wait(volatile struct avr_thread_event *event,
+                      uint8_t mask, uint8_t options)
+{
+    return avr_thread_event_wait_common(event, mask, options, 0, 0);
+}
+
+uint8_t
+avr_thread_event_wait_timed(volatile struct avr_thread_event *event,
+                            uint8_t mask, uint8_t options,
+                            uint32_t deadline)
+{
+    return avr_thread_event_wait_common(event, mask, options, 1,
+                                        deadline);
+}
+
+static uint8_t
+avr_thread_event_wait_common(volatile struct avr_thread_event *event,
+                             uint8_t mask, uint8_t options, uint8_t timed,
+                             uint32_t deadline)
+{
+    uint8_t         sreg;
+    uint8_t         bits;
+    volatile struct avr_thread *t;
+
+    if (event == NULL || mask == 0) {
+        return 0;
+    }
+
+    sreg = SREG;
+    cli();
+
+    bits = event->bits & mask;
+    if ((options & AVR_THREAD_EVENT_ALL) ? bits == mask : bits != 0) {
+        if (options & AVR_THREAD_EVENT_CLEAR) {
+            event->bits &= ~mask;
+        }
+        SREG = sreg;
+        return bits;
+    }
+
+    /*
+     * Whoever sets the bits checks our condition, clears the bits for
+     * us if asked to, and leaves the result in `event_mask'.
+     */
+    if (!avr_thread_wait_begin(&event->wait_queue, ats_waiting, timed,
+                               deadline)) {
+        SREG = sreg;
+        return 0;
+    }
+    t = avr_thread_active_thread;
+    t->event_mask = mask;
+    t->event_options = options;
+
+    bits = avr_thread_wait_end() == awr_ok ? t->event_mask : 0;
+    SREG = sreg;
+    return bits;
+}
+
+/*
+ * Sets bits and wakes up the waiters that are satisfied. The bits the
+ * woken waiters want cleared are only cleared once every waiter has been
+ * looked at, so that all of those waiting for the same bit see it.
+ *
+ * Must be called with interrupts disabled.
+ */
+static void
+avr_thread_event_post(volatile struct avr_thread_event *event,
+                      uint8_t bits)
+{
+    volatile struct avr_thread *t,
+                   *n;
+    uint8_t         matched,
+                    clear;
+
+    event->bits |= bits;
+    clear = 0;
+
+    for (t = event->wait_queue.head; t != NULL; t = n) {
+        n = t->wait_queue_next;
+        matched = event->bits & t->event_mask;
+        if ((t->event_options & AVR_THREAD_EVENT_ALL) ?
+            matched != t->event_mask : matched == 0) {
+            continue;
+        }
+        if (t->event_options & AVR_THREAD_EVENT_CLEAR) {
+            clear |= t->event_mask;
+        }
+        t->event_mask = matched;
+        avr_thread_wait_queue_remove(&event->wait_queue, t);
+        t->state = ats_runnable;
+        avr_thread_run_queue_push(t);
+        AVR_THREAD_TRACE(ate_wake, t, 0);
+    }
+
+    event->bits &= ~clear;
+}
+
+void
+avr_thread_event_set(volatile struct avr_thread_event *event,
+                     uint8_t bits)
+{
+    uint8_t         sreg;
+
+    if (event == NULL) {
+        return;
+    }
+
+    sreg = SREG;
+    cli();
+
+    avr_thread_event_post(event, bits);
+    if (avr_thread_run_queue_bitmap != 0 &&
+        avr_thread_run_queue_top() > avr_thread_active_thread->priority) {
+        avr_thread_yield();
+    }
+
+    SREG = sreg;
+}
+
+void
+avr_thread_event_set_from_isr(volatile struct avr_thread_event *event,
+                              uint8_t bits)
+{
+    uint8_t         sreg;
+
+    if (event == NULL) {
+        return;
+    }
+
+    /*
+     * Interrupts are usually disabled here already, unless the handler
+     * enabled them again.
+     */
+    sreg = SREG;
+    cli();
+
+    /*
+     * Pushing a woken thread to the run queue asks for a tick if it may
+     * preempt the active one.
+     */
+    avr_thread_event_post(event, bits);
+
+    SREG = sreg;
+}
+
+void
+avr_thread_event_clear(volatile struct avr_thread_event *event,
+                       uint8_t bits)
+{
+    uint8_t         sreg;
+
+    if (event == NULL) {
+        return;
+    }
+
+    sreg = SREG;
+    cli();
+    event->bits &= ~bits;
+    SREG = sreg;
+}
+
+uint8_t
+avr_thread_event_get(volatile struct avr_thread_event *event)
+{
+    if (event == NULL) {
+        return 0;
+    }
+    return event->bits;
+}
+
+/**
+ * Condition variable
+ * ==================
+ */
+
+#ifndef NO_HEAP
+struct avr_thread_cond *
+avr_thread_cond_init(void)
+{
+    struct avr_thread_cond *cond;
+
+    cond = malloc(sizeof(struct avr_thread_cond));
+    if (cond == NULL) {
+        return NULL;
+    }
+
+    return avr_thread_cond_init_static(cond);
+}
+
+void
+avr_thread_cond_destroy(volatile struct avr_thread_cond *cond)
+{
+    uint8_t         sreg;
+
+    sreg = SREG;
+    cli();
+
+    if (cond != NULL) {
+        free(cond);
+    }
+
+    SREG = sreg;
+}
+#endif
+
+struct avr_thread_cond *
+avr_thread_cond_init_static(struct avr_thread_cond *cond)
+{
+    if (cond == NULL) {
+        return NULL;
+    }
+    cond->wait_queue.head = NULL;
+    cond->wait_queue.tail = NULL;
+
+    return cond;
+}
+
+void
+avr_thread_cond_wait(volatile struct avr_thread_cond *cond,
+                     volatile struct avr_thread_mutex *mutex)
+{
+    avr_thread_cond_wait_common(cond, mutex, 0, 0);
+}
+
+enum avr_thread_wait_result
+avr_thread_cond_wait_timed(volatile struct avr_thread_cond *cond,
+                           volatile struct avr_thread_mutex *mutex,
+                           uint32_t deadline)
+{
+    return avr_thread_cond_wait_common(cond, mutex, 1, deadline);
+}
+
+static enum avr_thread_wait_result
+avr_thread_cond_wait_common(volatile struct avr_thread_cond *cond,
+                            volatile struct avr_thread_mutex *mutex,
+                            uint8_t timed, uint32_t deadline)
+{
+    uint8_t         sreg;
+    enum avr_thread_wait_result result;
+
+    if (cond == NULL || mutex == NULL) {
+        return awr_ok;
+    }
+
+    sreg = SREG;
+    cli();
+
+    /*
+     * Get in line before letting go of the mutex. Nobody can signal
+     * before we are in the queue, since interrupts stay disabled until we
+     * yield.
+     */
+    if (!avr_thread_wait_begin(&cond->wait_queue, ats_waiting, timed,
+                               deadline)) {
+        SREG = sreg;
+        return awr_timeout;
+    }
+
+    /*
+     * The unlock yields by itself if it wakes up somebody more important.
+     * In that case we are back only once signalled or timed out.
+     */
+    avr_thread_mutex_unlock(mutex);
+    result = avr_thread_wait_end();
+
+    avr_thread_mutex_lock(mutex);
+    SREG = sreg;
+    return result;
+}
+
+/*
+ * Wakes up the most important waiter, or all of them, and yields if one
+ * of them is more important than the caller.
+ */
+static void
+avr_thread_cond_wake(volatile struct avr_thread_cond *cond, uint8_t all)
+{
+    uint8_t         sreg;
+    volatile struct avr_thread *t;
+
+    if (cond == NULL) {
+        return;
+    }
+
+    sreg = SREG;
+    cli();
+
+    while ((t = avr_thread_wait_queue_pop_best(&cond->wait_queue)) != NULL) {
+        t->state = ats_runnable;
+        avr_thread_run_queue_push(t);
+        AVR_THREAD_TRACE(ate_wake, t, 0);
+        if (!all) {
+            break;
+        }
+    }
+
+    if (avr_thread_run_queue_bitmap != 0 &&
+        avr_thread_run_queue_top() > avr_thread_active_thread->priority) {
+        avr_thread_yield();
+    }
+
+    SREG = sreg;
+}
+
+void
+avr_thread_cond_signal(volatile struct avr_thread_cond *cond)
+{
+    avr_thread_cond_wake(cond, 0);
+}
+
+void
+avr_thread_cond_broadcast(volatile struct avr_thread_cond *cond)
+{
+    avr_thread_cond_wake(cond, 1);
+}
+
+/**
+ * Message queue
+ * =============
+ */
+
+#ifndef NO_HEAP
+struct avr_thread_queue *
+avr_thread_queue_init(uint8_t item_size, uint8_t capacity)
+{
+    struct avr_thread_queue *queue;
+
+    if (item_size == 0 || capacity == 0) {
+        return NULL;
+    }
+
+    /*
+     * One block for both, so that destroying the queue is a single free().
+     */
+    queue = malloc(sizeof(struct avr_thread_queue) +
+                   (uint16_t) item_size * capacity);
+    if (queue == NULL) {
+        return NULL;
+    }
+
+    return avr_thread_queue_init_static(queue, queue + 1, item_size,
+                                        capacity);
+}
+
+void
+avr_thread_queue_destroy(volatile struct avr_thread_queue *queue)
+{
+    uint8_t         sreg;
+
+    sreg = SREG;
+    cli();
+
+    if (queue != NULL) {
+        free(queue);
+    }
+
+    SREG = sreg;
+}
+#endif
+
+struct avr_thread_queue *
+avr_thread_queue_init_static(struct avr_thread_queue *queue, void *buffer,
+                             uint8_t item_size, uint8_t capacity)
+{
+    if (queue == NULL || buffer == NULL || item_size == 0 ||
+        capacity == 0) {
+        return NULL;
+    }
+    queue->buffer = buffer;
+    queue->item_size = item_size;
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    queue->senders.head = NULL;
+    queue->senders.tail = NULL;
+    queue->receivers.head = NULL;
+    queue->receivers.tail = NULL;
+
+    return queue;
+}
+
+/*
+ * Copies `item' behind the newest item. The queue must not be full.
+ *
+ * Must be called with interrupts disabled.
+ */
+static void
+avr_thread_queue_put(volatile struct avr_thread_queue *queue,
+                     const void *item)
+{
+    uint8_t        *dst;
+    const uint8_t  *src;
+    uint8_t         i;
+
+    i = queue->head + queue->count;
+    if (i >= queue->capacity) {
+        i -= queue->capacity;
+    }
+    dst = queue->buffer + (uint16_t) i * queue->item_size;
+    src = item;
+    for (i = 0; i < queue->item_size; ++i) {
+        dst[i] = src[i];
+    }
+    ++queue->count;
+}
+
+/*
+ * Copies the oldest item to `item' and removes it. The queue must not be
+ * empty.
+ *
+ * Must be called with interrupts disabled.
+ */
+static void
+avr_thread_queue_get(volatile struct avr_thread_queue *queue, void *item)
+{
+    uint8_t        *dst;
+    const uint8_t  *src;
+    uint8_t         i;
+
+    src = queue->buffer + (uint16_t) queue->head * queue->item_size;
+    dst = item;
+    for (i = 0; i < queue->item_size; ++i) {
+        dst[i] = src[i];
+    }
+    if (++queue->head == queue->capacity) {
+        queue->head = 0;
+    }
+    --queue->count;
+}
+
+void
+avr_thread_queue_send(volatile struct avr_thread_queue *queue,
+                      const void *item)
+{
+    avr_thread_queue_send_common(queue, item, 0, 0);
+}
+
+enum avr_thread_wait_result
+avr_thread_queue_send_timed(volatile struct avr_thread_queue *queue,
+                            const void *item, uint32_t deadline)
+{
+    return avr_thread_queue_send_common(queue, item, 1, deadline);
+}
+
+static enum avr_thread_wait_result
+avr_thread_queue_send_common(volatile struct avr_thread_queue *queue,
+                             const void *item, uint8_t timed,
+                             uint32_t deadline)
+{
+    uint8_t         sreg;
+
+    if (queue == NULL) {
+        return awr_ok;
+    }
+
+    sreg = SREG;
+    cli();
+
+    while (queue->count == queue->capacity) {
+        if (!avr_thread_wait_begin(&queue->senders, ats_waiting, timed,
+                                   deadline) ||
+            avr_thread_wait_end() == awr_timeout) {
+            SREG = sreg;
+            return awr_timeout;
+        }
+    }
+    avr_thread_queue_put(queue, item);
+    if (avr_thread_wait_queue_wake(&queue->receivers)) {
+        avr_thread_yield();
+    }
+
+    SREG = sreg;
+    return awr_ok;
+}
+
+void
+avr_thread_queue_receive(volatile struct avr_thread_queue *queue,
+                         void *item)
+{
+    avr_thread_queue_receive_common(queue, item, 0, 0);
+}
+
+enum avr_thread_wait_result
+avr_thread_queue_receive_timed(volatile struct avr_thread_queue *queue,
+                               void *item, uint32_t deadline)
+{
+    return avr_thread_queue_receive_common(queue, item, 1, deadline);
+}
+
+static enum avr_thread_wait_result
+avr_thread_queue_receive_common(volatile struct avr_thread_queue *queue,
+                                void *item, uint8_t timed,
+                                uint32_t deadline)
+{
+    uint8_t         sreg;
+
+    if (queue == NULL) {
+        return awr_ok;
+    }
+
+    sreg = SREG;
+    cli();
+
+    while (queue->count == 0) {
+        if (!avr_thread_wait_begin(&queue->receivers, ats_waiting, timed,
+                                   deadline) ||
+            avr_thread_wait_end() == awr_timeout) {
+            SREG = sreg;
+            return awr_timeout;
+        }
+    }
+    avr_thread_queue_get(queue, item);
+    if (avr_thread_wait_queue_wake(&queue->senders)) {
+        avr_thread_yield();
+    }
+
+    SREG = sreg;
+    return awr_ok;
+}
+
+uint8_t
+avr_thread_queue_try_send(volatile struct avr_thread_queue *queue,
+                          const void *item)
+{
+    uint8_t         sreg;
+
+    if (queue == NULL) {
+        return 0;
+    }
+
+    sreg = SREG;
+    cli();
+
+    if (queue->count == queue->capacity) {
+        SREG = sreg;
+        return 0;
+    }
+    avr_thread_queue_put(queue, item);
+    if (avr_thread_wait_queue_wake(&queue->receivers)) {
+        avr_thread_yield();
+    }
+
+    SREG = sreg;
+    return 1;
+}
+
+uint8_t
+avr_thread_queue_try_receive(volatile struct avr_thread_queue *queue,
+                             void *item)
+{
+    uint8_t         sreg;
+
+    if (queue == NULL) {
+        return 0;
+    }
+
+    sreg = SREG;
+    cli();
+
+    if (queue->count == 0) {
+        SREG = sreg;
+        return 0;
+    }
+    avr_thread_queue_get(queue, item);
+    if (avr_thread_wait_queue_wake(&queue->senders)) {
+        avr_thread_yield();
+    }
+
+    SREG = sreg;
+    return 1;
+}
+
+uint8_t
+avr_thread_queue_post_from_isr(volatile struct avr_thread_queue *queue,
+                               const void *item)
+{
+    uint8_t         sreg;
+
+    if (queue == NULL) {
+        return 0;
+    }
+
+    sreg = SREG;
+    cli();
+
+    if (queue->count == queue->capacity) {
+        SREG = sreg;
+        return 0;
+    }
+    avr_thread_queue_put(queue, item);
+
+    /*
+     * Pushing the receiver to the run queue asks for a tick if it may
+     * preempt the interrupted thread. The receiver checks the queue
+     * again once it runs, since another thread may get there first.
+     */
+    avr_thread_wait_queue_wake(&queue->receivers);
+
+    SREG = sreg;
+    return 1;
+}
+
+uint8_t
+avr_thread_queue_count(volatile struct avr_thread_queue *queue)
+{
+    if (queue == NULL) {
+        return 0;
+    }
+    return queue->count;
 }
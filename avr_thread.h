@@ -41,14 +41,45 @@
  * Maximum number of valid threads 
  */
 #define MAX_NUM_THREADS 32
+/*
+ * Number of priority levels. The run queue keeps one FIFO per level and
+ * a bitmap of the non-empty levels in a uint8_t, so this cannot exceed 8.
+ */
+#define NUM_PRIORITIES  8
 /*
  * Quantum size 
  */
 #define DEFAULT_QUANTUM         3
 /*
- * The number of ticks per second 
+ * The default number of ticks per second. It can be changed at run time
+ * with avr_thread_set_tick_rate().
  */
 #define FIRE_PER_SEC    20
+/*
+ * The kernel timebase (Timer0) interrupts this many times per second,
+ * which is also the highest possible tick rate.
+ */
+#define TIMEBASE_HZ     1000
+/*
+ * Unused stack bytes hold this pattern, so that the deepest point a
+ * thread has ever reached can be found afterwards.
+ */
+#define STACK_PAINT     0xa5
+/*
+ * A thread is flagged (see avr_thread_stack_low()) once it has used its
+ * stack down to this many bytes from the bottom. Define it on the
+ * command line to change it.
+ */
+#ifndef STACK_MARGIN
+#define STACK_MARGIN    16
+#endif
+/*
+ * Number of records in the trace buffer (only with -DTRACE). Must be a
+ * power of two no greater than 128. Each record takes 6 bytes of SRAM.
+ */
+#ifndef TRACE_SIZE
+#define TRACE_SIZE      32
+#endif
 /*
  * 32 GP + 1 SREG 
  */
@@ -75,40 +106,112 @@
  * not possible by using avr_thread_sleep() or avr_thread_yield().
  */
 enum avr_thread_priority {
+    atp_lowest,
+    atp_low,
     atp_normal,
+    atp_above_normal,
     atp_important,
-    atp_critical
+    atp_high,
+    atp_critical,
+    atp_highest
+};
+
+/*
+ * Outcome of a wait with a deadline, i.e., of the *_timed() functions.
+ * Deadlines are times of avr_thread_now(), e.g., `avr_thread_now() + 20'
+ * for 20 milliseconds from now.
+ */
+enum avr_thread_wait_result {
+    awr_ok,                     /* Got what it waited for */
+    awr_timeout                 /* The deadline came first */
+};
+
+#ifdef TRACE
+/*
+ * Scheduler events recorded when compiled with -DTRACE.
+ */
+enum avr_thread_trace_event {
+    ate_switch,                 /* `thread' starts running */
+    ate_wake,                   /* `thread' becomes runnable */
+    ate_block,                  /* `thread' stops being runnable; `arg'
+                                 * is its new state */
+    ate_exit,                   /* `thread' terminates */
+    ate_lock,                   /* `thread' acquires the mutex `arg' */
+    ate_unlock,                 /* `thread' releases the mutex `arg' */
+    ate_lost                    /* `arg' records were dropped here
+                                 * because the buffer was full */
+};
+
+/*
+ * A trace record. The timestamp is `ms' milliseconds (the low 16 bits of
+ * avr_thread_now()) plus `tcnt' counts of the timebase, which are 4
+ * microseconds each at 16 MHz. Mutexes are identified by the low byte of
+ * their address.
+ */
+struct avr_thread_trace_record {
+    uint8_t         event;
+    uint8_t         thread;
+    uint8_t         arg;
+    uint8_t         tcnt;
+    uint16_t        ms;
+};
+#endif
+
+/*
+ * Timing of a periodic thread, see avr_thread_period_stats(). Times are
+ * in milliseconds; the counters wrap around.
+ */
+struct avr_thread_period_stats {
+    uint16_t        releases;   /* Periods started */
+    uint16_t        misses;     /* Periods started late because the
+                                 * previous one overran, or skipped */
+    uint16_t        last_jitter;        /* From the release of the
+                                         * current period until the
+                                         * thread ran */
+    uint16_t        max_jitter;
 };
 
 extern volatile uint8_t avr_thread_initialised;
 
+/*
+ * The kernel is tickless: it only asks for a tick when it has something
+ * to do (wake a sleeping thread, preempt, or end a quantum shared with
+ * another thread of the same priority).
+ *
+ * Only the timebase decrements this, once per millisecond, and calls
+ * avr_thread_tick() when it reaches zero; it skips it while it is zero,
+ * which means that no tick is needed. Kernel code may write it, from
+ * zero or not, but only with interrupts disabled.
+ */
+extern volatile uint16_t avr_thread_tick_countdown;
+
+/*
+ * Milliseconds since avr_thread_init(), incremented by the timebase.
+ * Use avr_thread_now() to read it.
+ */
+extern volatile uint32_t avr_thread_clock;
+
 /*
  * Here are the major structs. Yes, these four lines are everything a
  * programmer needs to know.
  *
- * You will not be able to put them on the stack (i.e., you cannot
- * have:
+ * Their members are defined in `avr_thread_struct.h' only so that the
+ * compiler knows their sizes. That lets you reserve them at compile time
+ * instead of getting them from malloc():
  *
  *  ...
- *  struct avr_thread foo;
+ *  static struct avr_thread foo;
+ *  static uint8_t foo_stack[100];
  *  ...
- *
- * in your code because the compiler does not know the size.
- * Please use:
- *
+ *  avr_thread_create_static(&foo, entry, foo_stack, sizeof foo_stack,
+ *                           atp_normal);
  *  ...
- *  struct avr_thread *foo;
- *  foo = avr_thread_create(...);
- *  ...
- *
- * instead.
  *
- * They are deliberately written as opaque data types to prevent
- * programmers from touching members of these structs in their programs.
+ * or, with the macros below, AVR_THREAD_STATIC(foo, 100) and
+ * AVR_THREAD_CREATE_STATIC(foo, entry, atp_normal).
  *
- * Note:
- * I know even I work hard to hide members from programmers, programmers
- * still can access the members by using pointer arithmetic...
+ * Nevertheless, they are still to be treated as opaque data types. Do
+ * not touch members of these structs in your programs.
  */
 
 struct avr_thread;
@@ -119,6 +222,31 @@ struct avr_thread_semaphore;
 
 struct avr_thread_rwlock;
 
+#include "avr_thread_struct.h"
+
+/*
+ * Reserves a thread and its stack of `stack_size' bytes at compile time.
+ */
+#define AVR_THREAD_STATIC(name, stack_size)                     \
+    static struct avr_thread name;                              \
+    static uint8_t  name##_stack[(stack_size)]
+
+/*
+ * Creates a thread reserved with AVR_THREAD_STATIC().
+ */
+#define AVR_THREAD_CREATE_STATIC(name, entry, priority)         \
+    avr_thread_create_static(&(name), (entry), name##_stack,    \
+                             sizeof(name##_stack), (priority))
+
+/*
+ * Starts a thread reserved with AVR_THREAD_STATIC() that runs every
+ * `period' milliseconds.
+ */
+#define AVR_THREAD_CREATE_PERIODIC_STATIC(name, entry, priority, period) \
+    avr_thread_create_periodic_static(&(name), (entry), name##_stack,   \
+                                      sizeof(name##_stack), (priority), \
+                                      (period))
+
 /**
  * Basic Operations
  * ================
@@ -131,6 +259,7 @@ struct avr_thread_rwlock;
 struct avr_thread *avr_thread_init(uint16_t main_stack_size, enum avr_thread_priority
                                    main_priority);
 
+#ifndef NO_HEAP
 /*
  * Create a new thread. The new threads will start at the `entry'
  * funtion after creation.
@@ -140,11 +269,114 @@ struct avr_thread *avr_thread_create(void (*entry) (void),
                                      uint16_t stack_size,
                                      enum avr_thread_priority
                                      priority);
+#endif
+/*
+ * Sets the number of ticks per second, from 1 to TIMEBASE_HZ. The rate
+ * is rounded to a whole number of milliseconds. Ticks are the unit of the
+ * quantum and of avr_thread_sleep().
+ */
+void            avr_thread_set_tick_rate(uint16_t ticks_per_sec);
+
+/*
+ * Returns the number of milliseconds since avr_thread_init(). It wraps
+ * around after about 49 days.
+ */
+uint32_t        avr_thread_now(void);
+
+/*
+ * Same as avr_thread_create(), except that the thread lives in `t'
+ * instead of memory from malloc(). `t' must stay valid until the thread
+ * has terminated.
+ */
+struct avr_thread *avr_thread_create_static(struct avr_thread *t,
+                                            void (*entry) (void),
+                                            uint8_t * stack,
+                                            uint16_t stack_size,
+                                            enum avr_thread_priority
+                                            priority);
+
 /*
  * Sleeps the current threads for specified ticks.
  */
 void            avr_thread_sleep(uint16_t ticks);
 
+/*
+ * Sleeps the current thread for specified milliseconds.
+ */
+void            avr_thread_sleep_ms(uint32_t ms);
+
+/*
+ * Sleeps the current thread until avr_thread_now() reaches `wake_time'.
+ * Returns immediately (after a yield) if that time has passed already.
+ * Handy for doing something at a fixed rate without drifting:
+ *
+ *  t = avr_thread_now();
+ *  for (;;) {
+ *      ...
+ *      t += 20;
+ *      avr_thread_sleep_until(t);
+ *  }
+ */
+void            avr_thread_sleep_until(uint32_t wake_time);
+
+/**
+ * Periodic threads
+ * ----------------
+ * A periodic thread is released every `period' milliseconds, at fixed
+ * times counted from its creation, and calls avr_thread_wait_next_period()
+ * when done with the current period:
+ *
+ *  void entry(void)
+ *  {
+ *      for (;;) {
+ *          ...
+ *          avr_thread_wait_next_period();
+ *      }
+ *  }
+ *
+ * However long each period takes, the release times do not drift.
+ */
+
+#ifndef NO_HEAP
+/*
+ * Same as avr_thread_create(), for a thread released every `period'
+ * milliseconds, the first time right away.
+ */
+struct avr_thread *avr_thread_create_periodic(void (*entry) (void),
+                                              uint8_t * stack,
+                                              uint16_t stack_size,
+                                              enum avr_thread_priority
+                                              priority, uint16_t period);
+#endif
+
+/*
+ * Same as avr_thread_create_static(), for a thread released every
+ * `period' milliseconds, the first time right away.
+ */
+struct avr_thread *avr_thread_create_periodic_static(struct avr_thread *t,
+                                                     void (*entry) (void),
+                                                     uint8_t * stack,
+                                                     uint16_t stack_size,
+                                                     enum
+                                                     avr_thread_priority
+                                                     priority,
+                                                     uint16_t period);
+
+/*
+ * Sleeps until the next release of the calling periodic thread. If that
+ * has passed already, the previous period overran: it counts as a miss
+ * and returns at once, skipping any release that passed entirely. Only
+ * yields in a thread that is not periodic.
+ */
+void            avr_thread_wait_next_period(void);
+
+/*
+ * Copies the timing statistics of periodic thread `t' to `stats'.
+ */
+void            avr_thread_period_stats(struct avr_thread *t,
+                                        struct avr_thread_period_stats
+                                        *stats);
+
 /*
  * Explicitly gives away the CPU. 
  *
@@ -175,7 +407,9 @@ void            avr_thread_resume(struct avr_thread *t);
 /*
  * Do NOT call this function in your program!
  *
- * It has specific purposes and should _only_ be called by the ISR.
+ * It has specific purposes and should _only_ be called by the timebase
+ * ISR in `avr_thread_switch.S', and only when avr_thread_tick_countdown
+ * has been counted down to zero.
  *
  * This function is responsible for:
  *  1. ticking the sleeping threads (wake them up if their timer is off)
@@ -186,12 +420,73 @@ void            avr_thread_resume(struct avr_thread *t);
 uint8_t        *avr_thread_tick(uint8_t * saved_sp);
 
 /*
- * Do NOT call this function in your programe!
+ * Do NOT call this function in your program either.
  *
- * This function should only be called by the assembly procedure in
- * `avr_thread_switch.S'.
+ * Called on the way out of a handler defined with AVR_THREAD_ISR(), with
+ * the interrupted thread saved at `saved_sp'. Returns the stack pointer
+ * of the thread to resume: a thread the handler woke up if it is more
+ * important, otherwise the interrupted one.
  */
-void            avr_thread_save_sp(uint8_t * sp);
+uint8_t        *avr_thread_isr_exit(uint8_t * saved_sp);
+
+#ifndef AVR_THREAD_HOST
+/*
+ * Defines an interrupt handler that may wake up threads, with
+ * avr_thread_sem_post_from_isr() and friends. If one of them is more
+ * important than the interrupted thread, the handler switches to it on
+ * return instead of leaving it for the next timebase interrupt:
+ *
+ *  AVR_THREAD_ISR(INT0_vect)
+ *  {
+ *      avr_thread_sem_post_from_isr(&sem);
+ *  }
+ *
+ * The handler saves every register, the way the timebase does, and
+ * must not enable interrupts.
+ */
+#define AVR_THREAD_ISR(vector)                                          \
+    static void vector##_body(void) __attribute__ ((used));             \
+    ISR(vector, ISR_NAKED)                                              \
+    {                                                                   \
+        __asm__ __volatile__("push r0\n\t"                              \
+                             "in r0, __SREG__\n\t"                     \
+                             "push r0\n\t"                              \
+                             "push r24\n\t"                             \
+                             "ldi r24, lo8(gs(" #vector "_body))\n\t"   \
+                             "sts avr_thread_isr_body, r24\n\t"         \
+                             "ldi r24, hi8(gs(" #vector "_body))\n\t"   \
+                             "sts avr_thread_isr_body + 1, r24\n\t"     \
+                             "pop r24\n\t"                              \
+                             "jmp avr_thread_isr_dispatch\n\t");        \
+    }                                                                   \
+    static void vector##_body(void)
+#endif
+
+/*
+ * Returns the number of bytes at the bottom of the stack of `t' that
+ * have never been used, i.e., the stack size minus the high-water mark.
+ * It walks the unused part of the stack, so keep it out of hot paths.
+ *
+ * For the main thread, this is relative to the `main_stack_size' given
+ * to avr_thread_init().
+ */
+uint16_t        avr_thread_stack_unused(struct avr_thread *t);
+
+/*
+ * Returns non-zero if `t' has come within STACK_MARGIN bytes of the
+ * bottom of its stack. The kernel checks this whenever it switches away
+ * from a thread, and the flag stays set once it has been raised.
+ */
+uint8_t         avr_thread_stack_low(struct avr_thread *t);
+
+#ifdef TRACE
+/*
+ * Takes the oldest record out of the trace buffer. Returns 0 if the
+ * buffer is empty. Threads are numbered in the order they are created:
+ * 0 is the main thread and 1 the idle thread.
+ */
+uint8_t         avr_thread_trace_read(struct avr_thread_trace_record *r);
+#endif
 
 /*
  * Cancels a thread.
@@ -235,6 +530,12 @@ void            avr_thread_exit(void);
  */
 void            avr_thread_join(struct avr_thread *t);
 
+/*
+ * Same as avr_thread_join(), but gives up at `deadline'.
+ */
+enum avr_thread_wait_result avr_thread_join_timed(struct avr_thread *t,
+                                                  uint32_t deadline);
+
 
 /**
  * Advanced Opeartions
@@ -250,19 +551,31 @@ void            avr_thread_join(struct avr_thread *t);
  * same thing with pthread will result in undefined behaviour.
  */
 
+#ifndef NO_HEAP
 /*
  * Creates a new thread.
  * c.f., pthread_mutex_init(3).
  */
 struct avr_thread_mutex *avr_thread_mutex_init(void);
+#endif
+
+/*
+ * Initialises a mutex in caller-provided storage and returns it.
+ */
+struct avr_thread_mutex *avr_thread_mutex_init_static(struct
+                                                      avr_thread_mutex
+                                                      *mutex);
 
+#ifndef NO_HEAP
 /*
  * Frees the resources allocated for the mutex.
+ * Must not be used on a mutex from avr_thread_mutex_init_static().
  * c.f., pthread_mutex_destory(3).
  */
 void            avr_thread_mutex_destory(volatile
                                          struct avr_thread_mutex
                                          *mutex);
+#endif
 /*
  * Locks mutex.  If the mutex is already locked, the calling thread will
  * block until the mutex becomes available.
@@ -272,8 +585,26 @@ void            avr_thread_mutex_lock(volatile
                                       struct avr_thread_mutex *mutex);
 
 /*
- * Unlocks mutex and unblocks the waiting threads.
+ * Same as avr_thread_mutex_lock(), but gives up at `deadline'. Whoever
+ * the caller lent its priority to gets its own back.
+ */
+enum avr_thread_wait_result avr_thread_mutex_lock_timed(volatile struct
+                                                        avr_thread_mutex
+                                                        *mutex,
+                                                        uint32_t
+                                                        deadline);
+
+/*
+ * Unlocks mutex. If threads are waiting, the mutex is handed directly to
+ * the one with the highest priority (the longest waiting one among
+ * equals) and only that thread is unblocked.
  * c.f., pthread_mutex_unlock(3).
+ *
+ * Mutexes implement priority inheritance: while a thread waits for a
+ * mutex, the owner runs at the waiter's priority if that is higher (and
+ * so does the owner of any mutex the owner waits for). The owner gets
+ * its own priority back when it unlocks, and yields if a thread it was
+ * holding up is now more important than itself.
  */
 void            avr_thread_mutex_unlock(volatile
                                         struct avr_thread_mutex
@@ -285,20 +616,38 @@ void            avr_thread_mutex_unlock(volatile
  * Note:
  * The type of semaphore's value is uint8_t. Overflowing will result in
  * undefined behaviour.
+ *
+ * Up and down only disable interrupts for a few instructions. An up()
+ * with threads waiting hands the unit straight to the most important
+ * one. Interrupt handlers use avr_thread_sem_post_from_isr().
  */
 
+#ifndef NO_HEAP
 /*
  * Creates a semaphore with `value' as the initial value.
  */
 struct avr_thread_semaphore *avr_thread_semaphore_init(int value);
+#endif
 
 
+/*
+ * Initialises a semaphore in caller-provided storage and returns it, or
+ * NULL if `value' is negative.
+ */
+struct avr_thread_semaphore *avr_thread_semaphore_init_static(struct
+                                                              avr_thread_semaphore
+                                                              *sem,
+                                                              int value);
+
+#ifndef NO_HEAP
 /*
  * Frees the resources allocated for the semaphore.
+ * Must not be used on a semaphore from avr_thread_semaphore_init_static().
  */
 void            avr_thread_semaphore_destroy(volatile
                                              struct avr_thread_semaphore
                                              *sem);
+#endif
 
 /*
  * a.k.a. signal()
@@ -306,12 +655,29 @@ void            avr_thread_semaphore_destroy(volatile
 void            avr_thread_sem_up(volatile struct avr_thread_semaphore
                                   *sem);
 
+/*
+ * Same as avr_thread_sem_up(), for interrupt handlers. A woken thread
+ * that is more important than the interrupted one takes over when a
+ * handler defined with AVR_THREAD_ISR() returns, or else at the next
+ * timebase interrupt.
+ */
+void            avr_thread_sem_post_from_isr(volatile struct
+                                             avr_thread_semaphore *sem);
+
 /*
  * a.k.a wait()
  */
 void            avr_thread_sem_down(volatile struct avr_thread_semaphore
                                     *sem);
 
+/*
+ * Same as avr_thread_sem_down(), but gives up at `deadline'.
+ */
+enum avr_thread_wait_result avr_thread_sem_down_timed(volatile struct
+                                                      avr_thread_semaphore
+                                                      *sem,
+                                                      uint32_t deadline);
+
 /**
  * Readers-writer lock
  * -------------------
@@ -320,19 +686,39 @@ void            avr_thread_sem_down(volatile struct avr_thread_semaphore
  * pthread_rwlock_unlock(3). Both the reader and the writer can called
  * this function to unlock the lock.
  * Yet, I distinguish between reader's unlock and writer's unlock().
+ *
+ * Up to 254 readers can hold the lock at once. Writers are preferred:
+ * once one is waiting, new readers wait behind it, and a writer
+ * unlocking hands the lock to the next writer before any reader. A
+ * steady stream of writers therefore keeps readers out.
+ *
+ * Taking or releasing the lock without waiting only disables interrupts
+ * for a few instructions.
  */
 
-
+#ifndef NO_HEAP
 /*
  * c.f., pthread_rwlock_init(3)
  */
 struct avr_thread_rwlock *avr_thread_rwlock_init(void);
+#endif
 
 /*
+ * Initialises a readers-writer lock in caller-provided storage and
+ * returns it.
+ */
+struct avr_thread_rwlock *avr_thread_rwlock_init_static(struct
+                                                        avr_thread_rwlock
+                                                        *rwlock);
+
+#ifndef NO_HEAP
+/*
+ * Must not be used on a lock from avr_thread_rwlock_init_static().
  * c.f., pthread_rwlock_destroy(3)
  */
 void            avr_thread_rwlock_destroy(volatile struct avr_thread_rwlock
                                           *rwlock);
+#endif
 
 /*
  * c.f., pthread_rwlock_rdlock(3)
@@ -340,12 +726,30 @@ void            avr_thread_rwlock_destroy(volatile struct avr_thread_rwlock
 void            avr_thread_rwlock_rdlock(volatile struct avr_thread_rwlock
                                          *rwlock);
 
+/*
+ * Same as avr_thread_rwlock_rdlock(), but gives up at `deadline'.
+ */
+enum avr_thread_wait_result avr_thread_rwlock_rdlock_timed(volatile struct
+                                                           avr_thread_rwlock
+                                                           *rwlock,
+                                                           uint32_t
+                                                           deadline);
+
 /*
  * c.f., pthread_rwlock_wrlock(3)
  */
 void            avr_thread_rwlock_wrlock(volatile struct avr_thread_rwlock
                                          *rwlock);
 
+/*
+ * Same as avr_thread_rwlock_wrlock(), but gives up at `deadline'.
+ */
+enum avr_thread_wait_result avr_thread_rwlock_wrlock_timed(volatile struct
+                                                           avr_thread_rwlock
+                                                           *rwlock,
+                                                           uint32_t
+                                                           deadline);
+
 /*
  * c.f., pthread_rwlock_unlock(3)
  */
@@ -358,4 +762,254 @@ void            avr_thread_rwlock_wrunlock(volatile struct avr_thread_rwlock
 void            avr_thread_rwlock_rdunlock(volatile struct avr_thread_rwlock
                                            *rwlock);
 
+/**
+ * Event flags
+ * -----------
+ * A group of 8 event bits. Threads wait for any or all of a set of bits
+ * and use no CPU until they are set. Bits stay set until cleared,
+ * either explicitly or by a waiter that asked for it.
+ *
+ * Setting bits never allocates memory or blocks, so interrupt handlers
+ * can do it with avr_thread_event_set_from_isr().
+ */
+
+/*
+ * Options of avr_thread_event_wait()
+ */
+#define AVR_THREAD_EVENT_ANY    0x00    /* Wait for any of the bits */
+#define AVR_THREAD_EVENT_ALL    0x01    /* Wait for all of the bits */
+#define AVR_THREAD_EVENT_CLEAR  0x02    /* Clear the bits waited for on
+                                         * return */
+
+#ifndef NO_HEAP
+/*
+ * Creates an event group with all bits clear.
+ */
+struct avr_thread_event *avr_thread_event_init(void);
+
+/*
+ * Frees the resources allocated for the event group.
+ * Must not be used on an event group from avr_thread_event_init_static().
+ */
+void            avr_thread_event_destroy(volatile struct avr_thread_event
+                                         *event);
+#endif
+
+/*
+ * Initialises an event group in caller-provided storage and returns it.
+ */
+struct avr_thread_event *avr_thread_event_init_static(struct
+                                                      avr_thread_event
+                                                      *event);
+
+/*
+ * Blocks until any (or, with AVR_THREAD_EVENT_ALL, all) of the bits in
+ * `mask' are set. Returns the bits of `mask' that were set when the
+ * wait ended.
+ */
+uint8_t         avr_thread_event_wait(volatile struct avr_thread_event
+                                      *event, uint8_t mask,
+                                      uint8_t options);
+
+/*
+ * Same as avr_thread_event_wait(), but gives up at `deadline', in which
+ * case it returns 0.
+ */
+uint8_t         avr_thread_event_wait_timed(volatile struct
+                                            avr_thread_event *event,
+                                            uint8_t mask, uint8_t options,
+                                            uint32_t deadline);
+
+/*
+ * Sets `bits' and wakes up the threads whose wait is now over. Yields if
+ * one of them is more important than the caller.
+ */
+void            avr_thread_event_set(volatile struct avr_thread_event
+                                     *event, uint8_t bits);
+
+/*
+ * Same as avr_thread_event_set(), for interrupt handlers. A woken thread
+ * that is more important than the interrupted one takes over when a
+ * handler defined with AVR_THREAD_ISR() returns, or else at the next
+ * timebase interrupt, i.e., within a millisecond.
+ */
+void            avr_thread_event_set_from_isr(volatile struct
+                                              avr_thread_event *event,
+                                              uint8_t bits);
+
+/*
+ * Clears `bits'.
+ */
+void            avr_thread_event_clear(volatile struct avr_thread_event
+                                       *event, uint8_t bits);
+
+/*
+ * Returns the bits currently set.
+ */
+uint8_t         avr_thread_event_get(volatile struct avr_thread_event
+                                     *event);
+
+/**
+ * Message queue
+ * -------------
+ * A FIFO of `capacity' fixed-size items, copied in and out of a ring
+ * buffer owned by the caller. Senders block while the queue is full and
+ * receivers while it is empty, so a fast producer is held back instead
+ * of losing items.
+ */
+
+#ifndef NO_HEAP
+/*
+ * Creates a queue of `capacity' items of `item_size' bytes, allocating
+ * the ring buffer along with it.
+ */
+struct avr_thread_queue *avr_thread_queue_init(uint8_t item_size,
+                                               uint8_t capacity);
+
+/*
+ * Frees the resources allocated for the queue.
+ * Must not be used on a queue from avr_thread_queue_init_static().
+ */
+void            avr_thread_queue_destroy(volatile struct avr_thread_queue
+                                         *queue);
+#endif
+
+/*
+ * Initialises a queue in caller-provided storage and returns it.
+ * `buffer' must hold `capacity' * `item_size' bytes.
+ */
+struct avr_thread_queue *avr_thread_queue_init_static(struct
+                                                      avr_thread_queue
+                                                      *queue,
+                                                      void *buffer,
+                                                      uint8_t item_size,
+                                                      uint8_t capacity);
+
+/*
+ * Copies `item' to the back of the queue, blocking while it is full.
+ */
+void            avr_thread_queue_send(volatile struct avr_thread_queue
+                                      *queue, const void *item);
+
+/*
+ * Copies the item at the front of the queue to `item' and removes it,
+ * blocking while the queue is empty.
+ */
+void            avr_thread_queue_receive(volatile struct avr_thread_queue
+                                         *queue, void *item);
+
+/*
+ * Same as avr_thread_queue_send(), but gives up at `deadline'.
+ */
+enum avr_thread_wait_result avr_thread_queue_send_timed(volatile struct
+                                                        avr_thread_queue
+                                                        *queue,
+                                                        const void *item,
+                                                        uint32_t
+                                                        deadline);
+
+/*
+ * Same as avr_thread_queue_receive(), but gives up at `deadline'.
+ */
+enum avr_thread_wait_result avr_thread_queue_receive_timed(volatile struct
+                                                           avr_thread_queue
+                                                           *queue,
+                                                           void *item,
+                                                           uint32_t
+                                                           deadline);
+
+/*
+ * Same as avr_thread_queue_send(), but returns 0 instead of blocking if
+ * the queue is full. Returns 1 otherwise.
+ */
+uint8_t         avr_thread_queue_try_send(volatile struct avr_thread_queue
+                                          *queue, const void *item);
+
+/*
+ * Same as avr_thread_queue_receive(), but returns 0 instead of blocking
+ * if the queue is empty. Returns 1 otherwise.
+ */
+uint8_t         avr_thread_queue_try_receive(volatile struct
+                                             avr_thread_queue *queue,
+                                             void *item);
+
+/*
+ * Same as avr_thread_queue_try_send(), for interrupt handlers. A woken
+ * receiver that is more important than the interrupted thread takes over
+ * when a handler defined with AVR_THREAD_ISR() returns, or else at the
+ * next timebase interrupt.
+ */
+uint8_t         avr_thread_queue_post_from_isr(volatile struct
+                                               avr_thread_queue *queue,
+                                               const void *item);
+
+/*
+ * Returns the number of items in the queue.
+ */
+uint8_t         avr_thread_queue_count(volatile struct avr_thread_queue
+                                       *queue);
+
+/**
+ * Condition variable
+ * ------------------
+ * Lets a thread holding a mutex sleep until another thread changes the
+ * state the mutex protects. Always wait in a loop that checks the state,
+ * since it may have changed again by the time the waiter runs.
+ */
+
+#ifndef NO_HEAP
+/*
+ * Creates a condition variable.
+ */
+struct avr_thread_cond *avr_thread_cond_init(void);
+
+/*
+ * Frees the resources allocated for the condition variable.
+ * Must not be used on one from avr_thread_cond_init_static().
+ */
+void            avr_thread_cond_destroy(volatile struct avr_thread_cond
+                                        *cond);
+#endif
+
+/*
+ * Initialises a condition variable in caller-provided storage and
+ * returns it.
+ */
+struct avr_thread_cond *avr_thread_cond_init_static(struct avr_thread_cond
+                                                    *cond);
+
+/*
+ * Unlocks `mutex', which the caller must hold, and blocks until `cond'
+ * is signalled, as one step: a signal sent after the mutex is released
+ * is not missed. Locks `mutex' again before returning.
+ */
+void            avr_thread_cond_wait(volatile struct avr_thread_cond
+                                     *cond,
+                                     volatile struct avr_thread_mutex
+                                     *mutex);
+
+/*
+ * Same as avr_thread_cond_wait(), but gives up at `deadline'. The mutex
+ * is locked again either way.
+ */
+enum avr_thread_wait_result avr_thread_cond_wait_timed(volatile struct
+                                                       avr_thread_cond
+                                                       *cond,
+                                                       volatile struct
+                                                       avr_thread_mutex
+                                                       *mutex,
+                                                       uint32_t deadline);
+
+/*
+ * Wakes up the most important thread waiting on `cond', if any.
+ */
+void            avr_thread_cond_signal(volatile struct avr_thread_cond
+                                       *cond);
+
+/*
+ * Wakes up all the threads waiting on `cond'.
+ */
+void            avr_thread_cond_broadcast(volatile struct avr_thread_cond
+                                          *cond);
+
 #endif
@@ -0,0 +1,180 @@
+/*-
+ * Copyright (c) 2012       Meitian Huang <_@freeaddr.info>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __THREAD_STRUCT_H
+#define __THREAD_STRUCT_H
+
+/*
+ * Here are the _definition_ of data structures.
+ *
+ * They are only visible so that the compiler knows their sizes, which is
+ * what lets threads and synchronisation objects live in static storage
+ * (see avr_thread_create_static() and friends). Do NOT include this file
+ * directly; include `avr_thread.h' instead.
+ */
+
+/*
+ * States of a thread
+ */
+enum avr_thread_state {
+    ats_invalid,                /* Cannot be run (stopped or
+                                 * uninitialised) */
+    ats_runnable,               /* Can be run */
+    ats_paused,                 /* Pausing, is not runnable until
+                                 * resume() */
+    ats_sleeping,               /* Sleeping, not runnable until timer
+                                 * runs off */
+    ats_joined,                 /* Joined to another thread, is not
+                                 * runnable until that thread stops */
+    ats_cancelled,              /* Cancelle by a thread */
+    ats_waiting                 /* Waiting to lock a mutex or a
+                                 * semaphore */
+};
+
+/*
+ * Flags of a thread
+ */
+#define ATF_STATIC      0x01    /* Storage is not from malloc() */
+#define ATF_STACK_LOW   0x02    /* Has come within STACK_MARGIN bytes
+                                 * of the bottom of its stack */
+#define ATF_LEAN_FRAME  0x04    /* Saved by avr_thread_switch_to(), not
+                                 * by the timebase */
+
+/*
+ * Threads blocked on a synchronisation object, the most important first
+ * and in the order they came among equals. Taking the head and unlinking
+ * are O(1), so interrupt handlers can wake waiters cheaply; enqueueing
+ * walks back from the tail past the less important waiters.
+ */
+struct avr_thread_wait_queue {
+    volatile struct avr_thread *head;
+    volatile struct avr_thread *tail;
+};
+
+struct avr_thread {
+    /*
+     * I am WARNING you: DO NOT TOUCH THESE MEMBERS in your program.
+     */
+    volatile enum avr_thread_state state;
+    uint8_t         flags;
+    uint8_t        *stack;      /* For stack checking */
+    uint16_t        stack_size; /* For stack checking */
+    uint8_t        *sp;         /* Saved stack pointer */
+    volatile uint16_t ticks;    /* Milliseconds left in the quantum */
+    volatile uint8_t quantum;   /* In ticks */
+    volatile enum avr_thread_priority priority; /* Effective priority */
+    enum avr_thread_priority base_priority;     /* Before inheritance */
+    volatile uint32_t wake_time;        /* Timer for sleeping */
+    volatile struct avr_thread *run_queue_prev;
+    volatile struct avr_thread *run_queue_next;
+    volatile struct avr_thread *sleep_queue_prev;
+    volatile struct avr_thread *sleep_queue_next;
+    volatile struct avr_thread *wait_queue_prev;
+    volatile struct avr_thread *wait_queue_next;
+    volatile struct avr_thread_wait_queue *waiting_in;
+    struct avr_thread_wait_queue joiners;       /* Waiting in join() */
+    volatile struct avr_thread_mutex *blocked_on;       /* Waiting for */
+    volatile struct avr_thread_mutex *held_mutexes;     /* Owning */
+    volatile uint8_t event_mask;        /* Event bits waited for, then
+                                         * the bits that were set */
+    uint8_t         event_options;
+    volatile enum avr_thread_wait_result wait_result;
+    uint16_t        period;     /* In milliseconds, 0 if not periodic */
+    uint32_t        release;    /* Of the current period */
+    struct avr_thread_period_stats period_stats;
+#ifdef SANITY
+    void           *owning;
+#endif
+#ifdef TRACE
+    uint8_t         id;         /* Thread number in trace records */
+#endif
+};
+
+struct avr_thread_mutex {
+    /*
+     * The unlocking thread hands the mutex over to a waiter, so `locked'
+     * may change behind the back of the thread that waits for it. Hence,
+     * `locked' must be `volatile'.
+     */
+    volatile uint8_t locked;
+    struct avr_thread_wait_queue wait_queue;
+    /*
+     * The thread holding the mutex, and the next mutex it holds. Needed
+     * for priority inheritance.
+     */
+    volatile struct avr_thread *owner;
+    volatile struct avr_thread_mutex *next_held;
+};
+
+struct avr_thread_semaphore {
+    /*
+     * I know you may not listen, yet do NOT touch these members.
+     */
+    volatile uint8_t lock_count;
+    struct avr_thread_wait_queue wait_queue;
+};
+
+struct avr_thread_event {
+    /*
+     * I know you may not listen, yet do NOT touch these members.
+     */
+    volatile uint8_t bits;
+    struct avr_thread_wait_queue wait_queue;
+};
+
+struct avr_thread_cond {
+    /*
+     * I know you may not listen, yet do NOT touch these members.
+     */
+    struct avr_thread_wait_queue wait_queue;
+};
+
+struct avr_thread_queue {
+    /*
+     * I know you may not listen, yet do NOT touch these members.
+     */
+    uint8_t        *buffer;
+    uint8_t         item_size;
+    uint8_t         capacity;   /* In items */
+    volatile uint8_t head;      /* Index of the oldest item */
+    volatile uint8_t count;
+    struct avr_thread_wait_queue senders;
+    struct avr_thread_wait_queue receivers;
+};
+
+struct avr_thread_rwlock {
+    /*
+     * I know you may not listen, yet do NOT touch these members.
+     */
+    volatile uint8_t state;     /* Number of readers holding it, or
+                                 * RWLOCK_WRITER */
+    struct avr_thread_wait_queue readers;
+    struct avr_thread_wait_queue writers;
+};
+
+#endif
@@ -0,0 +1,522 @@
+/*-
+ * Copyright (c) 2012       Meitian Huang <_@freeaddr.info>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Kernel microbenchmarks. Build with `make bench' and flash bench.hex, or
+ * run it in simavr with `make bench-sim'. Results come out of the UART
+ * (UART_BAUD, 8N1) as CSV, one line per benchmark, in CPU cycles:
+ *
+ *   name,samples,min,avg,max
+ *
+ * Lines starting with `#' are comments.
+ *
+ * Timer1 counts CPU cycles. It runs with the same 1 ms period as the
+ * kernel timebase (Timer0), so the two stay in phase and the time since
+ * the last timebase interrupt can be read straight off TCNT1.
+ */
+
+#include <stdlib.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/delay.h>
+
+#include "avr_thread.h"
+#include "meggyjr_basic.h"
+#include "uart.h"
+
+#define BENCH_SAMPLES   64
+#define BENCH_PERIOD    ((uint16_t) (F_CPU / TIMEBASE_HZ))
+
+struct bench_stat {
+    uint16_t        min;
+    uint16_t        max;
+    uint32_t        sum;
+    uint16_t        n;
+};
+
+/*
+ * The display ISRs, called directly to time them.
+ */
+void            TIMER2_COMPA_vect(void);
+void            TIMER2_COMPB_vect(void);
+
+AVR_THREAD_STATIC(partner, 128);
+
+static struct avr_thread_mutex mutex;
+
+static struct avr_thread_semaphore sem;
+
+static struct avr_thread_rwlock rwlock;
+
+/*
+ * Cost of reading TCNT1 twice, taken off every sample.
+ */
+static uint16_t bench_overhead;
+
+/*
+ * TCNT1 when the timebase raises its interrupt flag.
+ */
+static uint16_t bench_phase;
+
+static volatile uint16_t stamp;
+
+static volatile uint8_t running;
+
+static struct bench_stat st_a,
+                st_b;
+
+static void
+bench_reset(struct bench_stat *s)
+{
+    s->min = 0xffff;
+    s->max = 0;
+    s->sum = 0;
+    s->n = 0;
+}
+
+static uint16_t
+bench_since(uint16_t t0, uint16_t t1)
+{
+    return (t1 >= t0) ? t1 - t0 : t1 + BENCH_PERIOD - t0;
+}
+
+static void
+bench_record(struct bench_stat *s, uint16_t c)
+{
+    if (c < s->min) {
+        s->min = c;
+    }
+    if (c > s->max) {
+        s->max = c;
+    }
+    s->sum += c;
+    ++s->n;
+}
+
+/*
+ * Records the time from `t0' to now.
+ */
+static void
+bench_sample(struct bench_stat *s, uint16_t t0)
+{
+    uint16_t        c;
+
+    c = bench_since(t0, TCNT1);
+    bench_record(s, (c > bench_overhead) ? c - bench_overhead : 0);
+}
+
+static void
+bench_put_number(uint32_t n)
+{
+    char            buf[11];
+
+    ultoa(n, buf, 10);
+    uart_puts(buf);
+}
+
+static void
+bench_report(const char *name, struct bench_stat *s)
+{
+    uart_puts(name);
+    uart_putc(',');
+    bench_put_number(s->n);
+    uart_putc(',');
+    bench_put_number(s->n ? s->min : 0);
+    uart_putc(',');
+    bench_put_number(s->n ? s->sum / s->n : 0);
+    uart_putc(',');
+    bench_put_number(s->max);
+    uart_puts("\r\n");
+}
+
+/*
+ * Starts `entry' in the partner thread and resets the statistics.
+ */
+static void
+bench_start(void (*entry) (void), enum avr_thread_priority priority)
+{
+    bench_reset(&st_a);
+    bench_reset(&st_b);
+    running = 1;
+    AVR_THREAD_CREATE_STATIC(partner, entry, priority);
+}
+
+static void
+bench_calibrate(void)
+{
+    uint8_t         i;
+    uint16_t        t0,
+                    c;
+
+    bench_overhead = 0xffff;
+    for (i = 0; i < 16; ++i) {
+        t0 = TCNT1;
+        c = bench_since(t0, TCNT1);
+        if (c < bench_overhead) {
+            bench_overhead = c;
+        }
+    }
+
+    cli();
+    TIFR0 = (1 << OCF0A);
+    while (!(TIFR0 & (1 << OCF0A))) {
+    }
+    bench_phase = TCNT1;
+    sei();
+}
+
+/*
+ * Yield
+ * -----
+ * One-way switch from a thread calling avr_thread_yield() to another one
+ * returning from it, both ways.
+ */
+static void
+bench_yield_partner(void)
+{
+    for (;;) {
+        bench_sample(&st_a, stamp);
+        stamp = TCNT1;
+        avr_thread_yield();
+        if (!running) {
+            return;
+        }
+    }
+}
+
+static void
+bench_yield(void)
+{
+    uint8_t         i;
+    uint16_t        t0;
+
+    bench_reset(&st_a);
+    for (i = 0; i < BENCH_SAMPLES; ++i) {
+        t0 = TCNT1;
+        avr_thread_yield();
+        bench_sample(&st_a, t0);
+    }
+    bench_report("yield_alone", &st_a);
+
+    bench_start(bench_yield_partner, atp_normal);
+    for (i = 0; i < BENCH_SAMPLES; ++i) {
+        stamp = TCNT1;
+        avr_thread_yield();
+        bench_sample(&st_a, stamp);
+    }
+    running = 0;
+    avr_thread_join(&partner);
+    bench_report("yield_switch", &st_a);
+}
+
+/*
+ * Preemption
+ * ----------
+ * From the timebase interrupt to a higher priority thread woken up by it
+ * running, while a lower priority one is busy. Includes the interrupt
+ * response and avr_thread_tick().
+ */
+static void
+bench_preempt_partner(void)
+{
+    uint8_t         i;
+
+    for (i = 0; i < BENCH_SAMPLES; ++i) {
+        avr_thread_sleep_ms(1);
+        bench_record(&st_a, bench_since(bench_phase, TCNT1));
+    }
+    running = 0;
+}
+
+static void
+bench_preempt(void)
+{
+    bench_start(bench_preempt_partner, atp_high);
+    while (running) {
+    }
+    avr_thread_join(&partner);
+    bench_report("preempt_switch", &st_a);
+}
+
+/*
+ * Mutex
+ * -----
+ * Uncontended lock and unlock, then a contended lock that blocks (until
+ * the owner runs again) and the handoff from unlock to the waiter.
+ */
+static void
+bench_mutex_partner(void)
+{
+    uint8_t         i;
+
+    for (i = 0; i < BENCH_SAMPLES; ++i) {
+        stamp = TCNT1;
+        avr_thread_mutex_lock(&mutex);
+        bench_sample(&st_b, stamp);
+        avr_thread_mutex_unlock(&mutex);
+        avr_thread_yield();
+    }
+}
+
+static void
+bench_mutex(void)
+{
+    uint8_t         i;
+    uint16_t        t0;
+
+    bench_reset(&st_a);
+    bench_reset(&st_b);
+    for (i = 0; i < BENCH_SAMPLES; ++i) {
+        t0 = TCNT1;
+        avr_thread_mutex_lock(&mutex);
+        bench_sample(&st_a, t0);
+        t0 = TCNT1;
+        avr_thread_mutex_unlock(&mutex);
+        bench_sample(&st_b, t0);
+    }
+    bench_report("mutex_lock", &st_a);
+    bench_report("mutex_unlock", &st_b);
+
+    bench_start(bench_mutex_partner, atp_normal);
+    for (i = 0; i < BENCH_SAMPLES; ++i) {
+        avr_thread_mutex_lock(&mutex);
+        avr_thread_yield();
+        bench_sample(&st_a, stamp);
+        stamp = TCNT1;
+        avr_thread_mutex_unlock(&mutex);
+        avr_thread_yield();
+    }
+    avr_thread_join(&partner);
+    bench_report("mutex_lock_block", &st_a);
+    bench_report("mutex_handoff", &st_b);
+}
+
+/*
+ * Semaphore
+ * ---------
+ * Uncontended up and down, then from up to a blocked thread returning
+ * from down.
+ */
+static void
+bench_sem_partner(void)
+{
+    uint8_t         i;
+
+    for (i = 0; i < BENCH_SAMPLES; ++i) {
+        avr_thread_sem_down(&sem);
+        bench_sample(&st_a, stamp);
+    }
+}
+
+static void
+bench_sem(void)
+{
+    uint8_t         i;
+    uint16_t        t0;
+
+    bench_reset(&st_a);
+    bench_reset(&st_b);
+    for (i = 0; i < BENCH_SAMPLES; ++i) {
+        t0 = TCNT1;
+        avr_thread_sem_up(&sem);
+        bench_sample(&st_a, t0);
+        t0 = TCNT1;
+        avr_thread_sem_down(&sem);
+        bench_sample(&st_b, t0);
+    }
+    bench_report("sem_up", &st_a);
+    bench_report("sem_down", &st_b);
+
+    bench_start(bench_sem_partner, atp_normal);
+    for (i = 0; i < BENCH_SAMPLES; ++i) {
+        avr_thread_yield();
+        stamp = TCNT1;
+        avr_thread_sem_up(&sem);
+        avr_thread_yield();
+    }
+    avr_thread_join(&partner);
+    bench_report("sem_wake", &st_a);
+}
+
+/*
+ * Readers-writer lock
+ * -------------------
+ * Uncontended read and write paths.
+ */
+static void
+bench_rwlock(void)
+{
+    uint8_t         i;
+    uint16_t        t0;
+
+    bench_reset(&st_a);
+    bench_reset(&st_b);
+    for (i = 0; i < BENCH_SAMPLES; ++i) {
+        t0 = TCNT1;
+        avr_thread_rwlock_rdlock(&rwlock);
+        bench_sample(&st_a, t0);
+        t0 = TCNT1;
+        avr_thread_rwlock_rdunlock(&rwlock);
+        bench_sample(&st_b, t0);
+    }
+    bench_report("rwlock_rdlock", &st_a);
+    bench_report("rwlock_rdunlock", &st_b);
+
+    bench_reset(&st_a);
+    bench_reset(&st_b);
+    for (i = 0; i < BENCH_SAMPLES; ++i) {
+        t0 = TCNT1;
+        avr_thread_rwlock_wrlock(&rwlock);
+        bench_sample(&st_a, t0);
+        t0 = TCNT1;
+        avr_thread_rwlock_wrunlock(&rwlock);
+        bench_sample(&st_b, t0);
+    }
+    bench_report("rwlock_wrlock", &st_a);
+    bench_report("rwlock_wrunlock", &st_b);
+}
+
+/*
+ * Thread creation
+ * ---------------
+ * The new thread has a lower priority, so creating it does not switch.
+ */
+static void
+bench_nop_partner(void)
+{
+}
+
+static void
+bench_create(void)
+{
+    uint8_t         i;
+    uint16_t        t0;
+
+    bench_reset(&st_a);
+    for (i = 0; i < BENCH_SAMPLES; ++i) {
+        t0 = TCNT1;
+        AVR_THREAD_CREATE_STATIC(partner, bench_nop_partner, atp_low);
+        bench_sample(&st_a, t0);
+        avr_thread_join(&partner);
+    }
+    bench_report("thread_create", &st_a);
+}
+
+/*
+ * Display ISR
+ * -----------
+ * With the kernel timebase held off, so that nothing else can come in
+ * when the ISR returns. The vsync ISR runs once per frame rather than
+ * once per plane, but is the one that calls into the kernel.
+ */
+static void
+bench_display_isr(void)
+{
+    uint8_t         i;
+    uint16_t        t0;
+
+    bench_reset(&st_a);
+    TIMSK2 = 0;
+    TIMSK0 = 0;
+    for (i = 0; i < BENCH_SAMPLES; ++i) {
+        cli();
+        t0 = TCNT1;
+        TIMER2_COMPA_vect();
+        bench_sample(&st_a, t0);
+    }
+    bench_reset(&st_b);
+    for (i = 0; i < BENCH_SAMPLES; ++i) {
+        cli();
+        t0 = TCNT1;
+        TIMER2_COMPB_vect();
+        bench_sample(&st_b, t0);
+    }
+    TIMSK2 = 0;
+    TIMSK0 = (1 << OCIE0A);
+    bench_report("display_isr", &st_a);
+    bench_report("vsync_isr", &st_b);
+}
+
+int
+main(void)
+{
+    meggyjr_init();
+    uart_init();
+    avr_thread_init(256, atp_normal);
+
+    avr_thread_mutex_init_static(&mutex);
+    avr_thread_semaphore_init_static(&sem, 0);
+    avr_thread_rwlock_init_static(&rwlock);
+
+    /*
+     * The display would get in the way of everything but its own
+     * benchmark.
+     */
+    TIMSK2 = 0;
+
+    /*
+     * Timer1 in CTC mode, clk/1, with the period of the timebase.
+     */
+    TCCR1A = 0;
+    TCCR1B = (1 << WGM12) | (1 << CS10);
+    OCR1A = BENCH_PERIOD - 1;
+    TIMSK1 = 0;
+
+    bench_calibrate();
+
+    uart_puts("# avr_thread bench, CPU cycles at ");
+    bench_put_number(F_CPU);
+    uart_puts(" Hz, ");
+    bench_put_number(bench_overhead);
+    uart_puts(" cycles of timer overhead subtracted\r\n");
+    uart_puts("name,samples,min,avg,max\r\n");
+
+    bench_yield();
+    bench_preempt();
+    bench_mutex();
+    bench_sem();
+    bench_rwlock();
+    bench_create();
+    bench_display_isr();
+
+    uart_puts("# done\r\n");
+
+    /*
+     * Let the last byte go out, then stop. simavr exits when the CPU
+     * sleeps with interrupts disabled.
+     */
+    _delay_ms(1);
+    cli();
+    sleep_enable();
+    sleep_cpu();
+
+    return 0;
+}
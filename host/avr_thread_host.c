@@ -0,0 +1,254 @@
+/*-
+ * Copyright (c) 2012       Meitian Huang <_@freeaddr.info>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Host backend of avr_thread. See `avr_thread_host.h'.
+ */
+
+#define _GNU_SOURCE
+
+#include <signal.h>
+#include <string.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <avr/io.h>
+
+#include "avr_thread.h"
+#include "avr_thread_host.h"
+
+/*
+ * Stands for what the AVR keeps on the stack of a thread that is not
+ * running.
+ */
+struct avr_thread_host_context {
+    ucontext_t      uc;
+    void            (*entry) (void);
+    void            (*exit) (void);
+};
+
+/*
+ * avr_thread_switch.S
+ */
+void            avr_thread_switch_to(uint8_t * new_stack_pointer,
+                                     uint8_t * volatile *save_sp,
+                                     uint8_t lean);
+void            avr_thread_switch_to_without_save(uint8_t *
+                                                  new_stack_pointer);
+
+/*
+ * Unlike on the AVR, interrupts start out enabled, so that a host
+ * program does not need to call sei() before avr_thread_init().
+ */
+static volatile uint8_t avr_thread_host_sreg_value = 0x80;
+
+/*
+ * Milliseconds of the timebase not yet delivered because the I flag was
+ * clear.
+ */
+static volatile sig_atomic_t avr_thread_host_pending;
+
+static struct avr_thread_host_context avr_thread_host_main_context;
+
+static struct avr_thread_host_context *avr_thread_host_current =
+    &avr_thread_host_main_context;
+
+volatile uint8_t *
+avr_thread_host_sreg(void)
+{
+    return &avr_thread_host_sreg_value;
+}
+
+/*
+ * Every thread but the main one starts here, as if returning from an
+ * interrupt into `entry' with `exit' as the return address.
+ */
+static void
+avr_thread_host_start(void)
+{
+    struct avr_thread_host_context *c = avr_thread_host_current;
+
+    avr_thread_host_sreg_value |= 0x80;
+    c->entry();
+    c->exit();
+}
+
+/*
+ * getcontext() returns twice as far as the compiler knows, so it is kept
+ * away from any local variable that is still needed afterwards.
+ */
+static void
+avr_thread_host_getcontext(struct avr_thread_host_context *c)
+{
+    getcontext(&c->uc);
+}
+
+uint8_t        *
+avr_thread_host_context_init(void (*entry) (void), void (*exit) (void),
+                             uint8_t * stack, uint16_t stack_size)
+{
+    struct avr_thread_host_context *c;
+
+    if (stack == NULL) {
+        return (uint8_t *) & avr_thread_host_main_context;
+    }
+
+    c = (struct avr_thread_host_context *)
+        (((uintptr_t) (stack + stack_size) - sizeof(*c)) &
+         ~(uintptr_t) 15);
+
+    avr_thread_host_getcontext(c);
+    sigdelset(&c->uc.uc_sigmask, SIGALRM);
+    c->uc.uc_stack.ss_sp = stack;
+    c->uc.uc_stack.ss_size = (uint8_t *) c - stack;
+    c->uc.uc_link = NULL;
+    c->entry = entry;
+    c->exit = exit;
+    makecontext(&c->uc, avr_thread_host_start, 0);
+
+    return (uint8_t *) c;
+}
+
+void
+avr_thread_switch_to(uint8_t * new_stack_pointer,
+                     uint8_t * volatile *save_sp, uint8_t lean)
+{
+    struct avr_thread_host_context *prev = avr_thread_host_current;
+
+    /*
+     * swapcontext() always saves everything.
+     */
+    (void) lean;
+    *save_sp = (uint8_t *) prev;
+
+    avr_thread_host_current =
+        (struct avr_thread_host_context *) new_stack_pointer;
+    swapcontext(&prev->uc, &avr_thread_host_current->uc);
+
+    /*
+     * reti
+     */
+    avr_thread_host_sreg_value |= 0x80;
+}
+
+void
+avr_thread_switch_to_without_save(uint8_t * new_stack_pointer)
+{
+    avr_thread_host_current =
+        (struct avr_thread_host_context *) new_stack_pointer;
+    setcontext(&avr_thread_host_current->uc);
+}
+
+/*
+ * What TIMER0_COMPA_vect does, for all the milliseconds pending at once.
+ * Must be called with SIGALRM blocked and the I flag set.
+ */
+static void
+avr_thread_host_interrupt(void)
+{
+    struct avr_thread_host_context *prev,
+                   *next;
+    uint16_t        n;
+
+    avr_thread_host_sreg_value &= (uint8_t) ~0x80;
+
+    n = avr_thread_host_pending;
+    avr_thread_host_pending = 0;
+    avr_thread_clock += n;
+
+    if (avr_thread_tick_countdown != 0) {
+        if (avr_thread_tick_countdown > n) {
+            avr_thread_tick_countdown -= n;
+        } else {
+            avr_thread_tick_countdown = 0;
+            prev = avr_thread_host_current;
+            next = (struct avr_thread_host_context *)
+                avr_thread_tick((uint8_t *) prev);
+            if (next != prev) {
+                avr_thread_host_current = next;
+                swapcontext(&prev->uc, &next->uc);
+            }
+        }
+    }
+
+    avr_thread_host_sreg_value |= 0x80;
+}
+
+static void
+avr_thread_host_timebase(int sig)
+{
+    (void) sig;
+
+    ++avr_thread_host_pending;
+    if (avr_thread_host_sreg_value & 0x80) {
+        avr_thread_host_interrupt();
+    }
+}
+
+void
+avr_thread_host_timebase_init(void)
+{
+    struct sigaction sa;
+    struct itimerval it;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = avr_thread_host_timebase;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGALRM, &sa, NULL);
+
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = 1000000 / TIMEBASE_HZ;
+    it.it_value = it.it_interval;
+    setitimer(ITIMER_REAL, &it, NULL);
+}
+
+void
+avr_thread_host_sei(void)
+{
+    sigset_t        alrm,
+                    old;
+
+    __asm__ __volatile__("":::"memory");
+    sigemptyset(&alrm);
+    sigaddset(&alrm, SIGALRM);
+    sigprocmask(SIG_BLOCK, &alrm, &old);
+    avr_thread_host_sreg_value |= 0x80;
+    if (avr_thread_host_pending != 0) {
+        avr_thread_host_interrupt();
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+void
+avr_thread_host_sleep_cpu(void)
+{
+    pause();
+}
@@ -0,0 +1,81 @@
+/*-
+ * Copyright (c) 2012       Meitian Huang <_@freeaddr.info>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef __THREAD_HOST_H
+#define __THREAD_HOST_H
+
+#include <inttypes.h>
+
+/*
+ * Host (Linux) backend of avr_thread, used when AVR_THREAD_HOST is
+ * defined. It stands in for avr_thread_switch.S and Timer0:
+ *
+ * - A thread's saved stack pointer points to a ucontext at the top of
+ *   its stack, and context switches are swapcontext(3).
+ * - SREG is a variable. Clearing its I flag (cli()) holds the timebase
+ *   off just like on the AVR, without any system call.
+ * - The timebase is SIGALRM from an interval timer at TIMEBASE_HZ. A
+ *   signal that arrives while the I flag is clear is remembered and
+ *   delivered at the next signal with the I flag set, or at sei().
+ *
+ * Host threads need much larger stacks than AVR ones; 16 KiB is enough
+ * for the kernel and the signal frames. Code that is not reentrant, like
+ * stdio, must not be used by more than one thread at a time, since the
+ * timebase can preempt a thread anywhere.
+ */
+
+/*
+ * SREG lives in avr_thread_host.c. Going through a function keeps the
+ * compiler from moving memory accesses across reads and writes of SREG,
+ * which is what makes cli() ... SREG = sreg a critical section.
+ */
+volatile uint8_t *avr_thread_host_sreg(void);
+
+/*
+ * Builds the initial frame of a thread that starts at `entry' and calls
+ * `exit' when `entry' returns. Returns the value to be used as its stack
+ * pointer. `stack' is NULL for the thread that is already running.
+ */
+uint8_t        *avr_thread_host_context_init(void (*entry) (void),
+                                             void (*exit) (void),
+                                             uint8_t * stack,
+                                             uint16_t stack_size);
+
+/*
+ * Starts the timebase.
+ */
+void            avr_thread_host_timebase_init(void);
+
+/*
+ * sei() and sleep_cpu().
+ */
+void            avr_thread_host_sei(void);
+void            avr_thread_host_sleep_cpu(void);
+
+#endif
@@ -0,0 +1,278 @@
+/*-
+ * Copyright (c) 2012       Meitian Huang <_@freeaddr.info>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Scheduler, mutex, semaphore, readers-writer lock and queue throughput of avr_thread, measured on
+ * the host. Build with `make' in this directory.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "avr_thread.h"
+
+#define HOST_STACK_SIZE 16384
+
+AVR_THREAD_STATIC(ping, HOST_STACK_SIZE);
+AVR_THREAD_STATIC(pong, HOST_STACK_SIZE);
+
+static struct avr_thread_mutex mutex;
+
+static struct avr_thread_semaphore sem_ping,
+                sem_pong;
+
+static struct avr_thread_rwlock rwlock;
+
+#define QUEUE_SIZE 4
+
+static uint32_t queue_buffer[QUEUE_SIZE];
+
+static struct avr_thread_queue queue;
+
+static volatile uint32_t counter;
+
+static uint32_t iterations = 200000;
+
+static double
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench_report(const char *name, uint32_t ops, double seconds)
+{
+    printf("%-24s %10lu ops %10.0f ops/s %8.1f ns/op\n", name,
+           (unsigned long) ops, ops / seconds, seconds * 1e9 / ops);
+}
+
+/*
+ * Runs `a' and `b' in two threads of normal priority and waits for both.
+ */
+static double
+bench_run(void (*a) (void), void (*b) (void))
+{
+    double          start;
+
+    counter = 0;
+    start = bench_now();
+    AVR_THREAD_CREATE_STATIC(ping, a, atp_normal);
+    AVR_THREAD_CREATE_STATIC(pong, b, atp_normal);
+    avr_thread_join(&ping);
+    avr_thread_join(&pong);
+    return bench_now() - start;
+}
+
+static void
+yield_entry(void)
+{
+    uint32_t        i;
+
+    for (i = 0; i < iterations; ++i) {
+        avr_thread_yield();
+    }
+}
+
+/*
+ * The holder yields inside the critical section, so that every lock
+ * after the first one blocks and every unlock hands the mutex over.
+ */
+static void
+mutex_entry(void)
+{
+    uint32_t        i;
+
+    for (i = 0; i < iterations; ++i) {
+        avr_thread_mutex_lock(&mutex);
+        ++counter;
+        avr_thread_yield();
+        avr_thread_mutex_unlock(&mutex);
+    }
+}
+
+/*
+ * Same as mutex_entry(), as readers: both threads hold the lock at once,
+ * so nobody blocks.
+ */
+static void
+reader_entry(void)
+{
+    uint32_t        i;
+
+    for (i = 0; i < iterations; ++i) {
+        avr_thread_rwlock_rdlock(&rwlock);
+        ++counter;
+        avr_thread_yield();
+        avr_thread_rwlock_rdunlock(&rwlock);
+    }
+}
+
+static void
+sem_ping_entry(void)
+{
+    uint32_t        i;
+
+    for (i = 0; i < iterations; ++i) {
+        avr_thread_sem_up(&sem_ping);
+        avr_thread_sem_down(&sem_pong);
+    }
+}
+
+static void
+sem_pong_entry(void)
+{
+    uint32_t        i;
+
+    for (i = 0; i < iterations; ++i) {
+        avr_thread_sem_down(&sem_ping);
+        avr_thread_sem_up(&sem_pong);
+    }
+}
+
+static void
+producer_entry(void)
+{
+    uint32_t        i;
+
+    for (i = 0; i < iterations; ++i) {
+        avr_thread_queue_send(&queue, &i);
+    }
+}
+
+/*
+ * Counts the items that arrive in order.
+ */
+static void
+consumer_entry(void)
+{
+    uint32_t        i,
+                    item;
+
+    for (i = 0; i < iterations; ++i) {
+        avr_thread_queue_receive(&queue, &item);
+        if (item == i) {
+            ++counter;
+        }
+    }
+}
+
+static void
+sleep_entry(void)
+{
+    uint32_t        i;
+
+    for (i = 0; i < 500; ++i) {
+        avr_thread_sleep_ms(1);
+    }
+}
+
+static void
+nop_entry(void)
+{
+}
+
+int
+main(int argc, char **argv)
+{
+    uint32_t        i;
+    double          start,
+                    t;
+
+    if (argc > 1) {
+        iterations = strtoul(argv[1], NULL, 0);
+    }
+
+    if (avr_thread_init(HOST_STACK_SIZE, atp_normal) == NULL) {
+        fprintf(stderr, "avr_thread_init() failed\n");
+        return 1;
+    }
+    avr_thread_mutex_init_static(&mutex);
+    avr_thread_rwlock_init_static(&rwlock);
+    avr_thread_semaphore_init_static(&sem_ping, 0);
+    avr_thread_semaphore_init_static(&sem_pong, 0);
+    avr_thread_queue_init_static(&queue, queue_buffer,
+                                 sizeof queue_buffer[0], QUEUE_SIZE);
+
+    t = bench_run(yield_entry, yield_entry);
+    bench_report("yield (switches)", 2 * iterations, t);
+
+    start = bench_now();
+    for (i = 0; i < iterations; ++i) {
+        avr_thread_mutex_lock(&mutex);
+        avr_thread_mutex_unlock(&mutex);
+    }
+    bench_report("mutex uncontended", iterations, bench_now() - start);
+
+    t = bench_run(mutex_entry, mutex_entry);
+    if (counter != 2 * iterations) {
+        fprintf(stderr, "mutex: counter is %lu\n",
+                (unsigned long) counter);
+        return 1;
+    }
+    bench_report("mutex handoff", 2 * iterations, t);
+
+    start = bench_now();
+    for (i = 0; i < iterations; ++i) {
+        avr_thread_rwlock_rdlock(&rwlock);
+        avr_thread_rwlock_rdunlock(&rwlock);
+    }
+    bench_report("rwlock read uncontended", iterations,
+                 bench_now() - start);
+
+    t = bench_run(reader_entry, reader_entry);
+    if (counter != 2 * iterations) {
+        fprintf(stderr, "rwlock: counter is %lu\n",
+                (unsigned long) counter);
+        return 1;
+    }
+    bench_report("rwlock 2 readers", 2 * iterations, t);
+
+    t = bench_run(sem_ping_entry, sem_pong_entry);
+    bench_report("semaphore ping-pong", 2 * iterations, t);
+
+    t = bench_run(producer_entry, consumer_entry);
+    if (counter != iterations) {
+        fprintf(stderr, "queue: %lu items in order\n",
+                (unsigned long) counter);
+        return 1;
+    }
+    bench_report("queue send/receive", iterations, t);
+
+    t = bench_run(sleep_entry, nop_entry);
+    printf("%-24s %10d ops %10.3f ms/sleep (1 ms asked)\n",
+           "sleep_ms(1)", 500, t * 1e3 / 500);
+
+    return 0;
+}
@@ -0,0 +1,297 @@
+/*-
+ * Copyright (c) 2012       Meitian Huang <_@freeaddr.info>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Checks of kernel internals that the API alone cannot see, run on the
+ * host. The kernel is included rather than linked so that its static
+ * functions can be called. Build and run with `make check' in this
+ * directory.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+
+#include "../avr_thread.c"
+
+#define HOST_STACK_SIZE 16384
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__,   \
+                    #cond);                                             \
+            ++failures;                                                 \
+        }                                                               \
+    } while (0)
+
+AVR_THREAD_STATIC(worker, HOST_STACK_SIZE);
+AVR_THREAD_STATIC(worker_b, HOST_STACK_SIZE);
+AVR_THREAD_STATIC(worker_c, HOST_STACK_SIZE);
+
+static int      failures;
+
+static struct avr_thread_wait_queue wait_queue;
+
+#define QUEUE_SIZE      4
+#define QUEUE_ROUNDS    100
+#define QUEUE_BURST     3
+
+static uint16_t queue_buffer[QUEUE_SIZE];
+
+static struct avr_thread_queue queue;
+
+static uint16_t received[QUEUE_ROUNDS * QUEUE_BURST];
+
+/*
+ * Set by the worker threads for the main thread to check.
+ */
+static volatile uint8_t i_after_wait;
+static volatile enum avr_thread_wait_result wait_result;
+
+/*
+ * Blocks on `wait_queue' until it times out, i.e., through a real
+ * switch away and back, and looks at the I flag on the way out of
+ * avr_thread_wait_end().
+ */
+static void
+wait_end_entry(void)
+{
+    uint8_t         sreg;
+
+    sreg = SREG;
+    cli();
+    if (avr_thread_wait_begin(&wait_queue, ats_waiting, 1,
+                              avr_thread_now() + 5)) {
+        wait_result = avr_thread_wait_end();
+    }
+    i_after_wait = SREG & 0x80;
+    SREG = sreg;
+}
+
+static void
+test_wait_end_keeps_interrupts_disabled(void)
+{
+    i_after_wait = 0xff;
+    wait_result = awr_ok;
+    AVR_THREAD_CREATE_STATIC(worker, wait_end_entry, atp_normal);
+    avr_thread_join(&worker);
+
+    CHECK(wait_result == awr_timeout);
+    CHECK(i_after_wait == 0);
+    CHECK(SREG & 0x80);
+}
+
+/*
+ * Takes every item, blocking on the empty queue in between.
+ */
+static void
+receiver_entry(void)
+{
+    uint16_t        i;
+
+    for (i = 0; i < QUEUE_ROUNDS * QUEUE_BURST; ++i) {
+        avr_thread_queue_receive(&queue, &received[i]);
+    }
+}
+
+/*
+ * The main thread stands in for an interrupt handler: it posts a burst
+ * with interrupts disabled while the receiver is blocked, then lets it
+ * run.
+ */
+static void
+test_queue_post_from_isr(void)
+{
+    uint16_t        i,
+                    n;
+    uint8_t         posted;
+
+    avr_thread_queue_init_static(&queue, queue_buffer,
+                                 sizeof queue_buffer[0], QUEUE_SIZE);
+    AVR_THREAD_CREATE_STATIC(worker, receiver_entry, atp_high);
+    avr_thread_yield();
+
+    n = 0;
+    for (i = 0; i < QUEUE_ROUNDS; ++i) {
+        CHECK(worker.state == ats_waiting);
+        cli();
+        for (posted = 0; posted < QUEUE_BURST; ++posted, ++n) {
+            CHECK(avr_thread_queue_post_from_isr(&queue, &n));
+        }
+        sei();
+        while (queue.count != 0) {
+            avr_thread_yield();
+        }
+    }
+    avr_thread_join(&worker);
+
+    for (i = 0; i < QUEUE_ROUNDS * QUEUE_BURST; ++i) {
+        CHECK(received[i] == i);
+    }
+    CHECK(queue.count == 0);
+    CHECK(queue.receivers.head == NULL);
+}
+
+static struct avr_thread_semaphore sem;
+
+static volatile struct avr_thread *volatile wake_order[3];
+static volatile uint8_t woken;
+
+static void
+sem_waiter_entry(void)
+{
+    avr_thread_sem_down(&sem);
+    wake_order[woken++] = avr_thread_active_thread;
+}
+
+/*
+ * A low priority waiter that came first is woken after two high
+ * priority ones, and those two in the order they came: the wait queue
+ * keeps its head the most important waiter.
+ */
+static void
+test_wait_queue_priority_order(void)
+{
+    uint8_t         i;
+
+    avr_thread_semaphore_init_static(&sem, 0);
+    woken = 0;
+    AVR_THREAD_CREATE_STATIC(worker, sem_waiter_entry, atp_low);
+    avr_thread_sleep_ms(2);
+    AVR_THREAD_CREATE_STATIC(worker_b, sem_waiter_entry, atp_high);
+    avr_thread_sleep_ms(2);
+    AVR_THREAD_CREATE_STATIC(worker_c, sem_waiter_entry, atp_high);
+    avr_thread_sleep_ms(2);
+
+    CHECK(sem.wait_queue.head == &worker_b);
+    CHECK(sem.wait_queue.tail == &worker);
+
+    for (i = 0; i < 3; ++i) {
+        avr_thread_sem_up(&sem);
+        avr_thread_sleep_ms(2);
+    }
+    avr_thread_join(&worker);
+    avr_thread_join(&worker_b);
+    avr_thread_join(&worker_c);
+
+    CHECK(woken == 3);
+    CHECK(wake_order[0] == &worker_b);
+    CHECK(wake_order[1] == &worker_c);
+    CHECK(wake_order[2] == &worker);
+}
+
+static volatile enum avr_thread_wait_result join_result[2];
+
+static void
+sleeper_entry(void)
+{
+    avr_thread_sleep_ms(20);
+}
+
+static void
+timed_joiner_entry(void)
+{
+    join_result[0] = avr_thread_join_timed(&worker, avr_thread_now() + 5);
+}
+
+static void
+joiner_entry(void)
+{
+    join_result[1] = avr_thread_join_timed(&worker, avr_thread_now() + 100);
+}
+
+/*
+ * A joiner that times out is off the joiners of the target straight
+ * away, and one woken by the exit is off them too, so that neither has
+ * to look at the target (which may be freed by then) afterwards.
+ */
+static void
+test_join_timeout(void)
+{
+    join_result[0] = join_result[1] = awr_ok;
+    AVR_THREAD_CREATE_STATIC(worker, sleeper_entry, atp_normal);
+    AVR_THREAD_CREATE_STATIC(worker_b, timed_joiner_entry, atp_normal);
+    AVR_THREAD_CREATE_STATIC(worker_c, joiner_entry, atp_normal);
+    avr_thread_join(&worker_b);
+
+    CHECK(join_result[0] == awr_timeout);
+    CHECK(worker.joiners.head == &worker_c);
+    CHECK(worker.joiners.tail == &worker_c);
+
+    avr_thread_join(&worker_c);
+    CHECK(join_result[1] == awr_ok);
+    CHECK(worker.state == ats_invalid);
+    CHECK(worker.joiners.head == NULL);
+    CHECK(worker_c.waiting_in == NULL);
+}
+
+static void
+nop_entry(void)
+{
+}
+
+/*
+ * A stack too small to start a thread on makes both create calls fail,
+ * up to and including MIN_STACK_SIZE, below which avr_thread_init_thread()
+ * leaves the thread alone.
+ */
+static void
+test_create_static_min_stack(void)
+{
+    CHECK(avr_thread_create_static(&worker, nop_entry, worker_stack,
+                                   MIN_STACK_SIZE, atp_normal) == NULL);
+    CHECK(avr_thread_create_periodic_static(&worker, nop_entry,
+                                            worker_stack, 8, atp_normal,
+                                            10) == NULL);
+    CHECK(avr_thread_create_periodic_static(&worker, nop_entry,
+                                            worker_stack, MIN_STACK_SIZE,
+                                            atp_normal, 10) == NULL);
+}
+
+int
+main(void)
+{
+    if (avr_thread_init(HOST_STACK_SIZE, atp_normal) == NULL) {
+        fprintf(stderr, "avr_thread_init() failed\n");
+        return 1;
+    }
+
+    test_wait_end_keeps_interrupts_disabled();
+    test_queue_post_from_isr();
+    test_create_static_min_stack();
+    test_wait_queue_priority_order();
+    test_join_timeout();
+
+    if (failures != 0) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
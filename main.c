@@ -33,8 +33,19 @@
 #include <avr/eeprom.h>
 
 #include "meggyjr.h"
+#include "meggyjr_basic.h"
+#ifdef TRACE
+#include "uart.h"
+#endif
 
 #define MAX_SCORE 4096
+/*
+ * Display refreshes per animation step: about 50 ms at the ~122 Hz the
+ * display really runs at, since BCM_UNIT rounds the period down. Counted
+ * in refreshes rather than scheduler ticks so that
+ * avr_thread_set_tick_rate() leaves the animations alone.
+ */
+#define STEP_REFRESHES 6
 #define ABS(a) (((a) < 0) ? -(a) : (a))
 
 /*
@@ -85,15 +96,51 @@ int             tune_win[] =
 int             tune_lose[] =
     { ToneG4, ToneE4, ToneF4, ToneE4, ToneD4, ToneC4, ToneC4, 0 };
 
-struct avr_thread_mutex
-               *mutex_button_pressed,
-               *mutex_save_point;
+struct avr_thread_mutex save_point_storage;
+
+struct avr_thread_mutex *mutex_save_point;
+
+/*
+ * Signalled, under mutex_save_point, when the game changes in a way
+ * worth saving.
+ */
+struct avr_thread_cond save_point_cond;
+
+uint8_t         game_changed;
+
+/*
+ * Set by the pin change interrupt of the buttons.
+ */
+#define BUTTON_CHANGED  0x01
+
+/*
+ * Time for a button to stop bouncing, in milliseconds.
+ */
+#define BUTTON_DEBOUNCE 5
+
+struct avr_thread_event button_event;
+
+/*
+ * Presses the button thread passes on to the game, oldest first.
+ */
+enum button {
+    button_a,
+    button_up,
+    button_down,
+    button_left,
+    button_right
+};
+
+#define BUTTON_QUEUE_SIZE 8
+
+/*
+ * The LED pattern moves on every LED_PERIOD milliseconds.
+ */
+#define LED_PERIOD      500
+
+uint8_t         button_queue_buffer[BUTTON_QUEUE_SIZE];
 
-volatile uint8_t button_a;
-volatile uint8_t button_up;
-volatile uint8_t button_down;
-volatile uint8_t button_left;
-volatile uint8_t button_right;
+struct avr_thread_queue button_queue;
 
 struct avr_thread
                *main_thread,
@@ -101,10 +148,42 @@ struct avr_thread
                *led_thread,
                *save_point_thread;
 
-uint8_t         key_stack[50],
-                led_stack[50],
+struct avr_thread button_thread_storage,
+                led_thread_storage,
+                save_point_thread_storage;
+
+/*
+ * Stacks of the button, LED and trace threads. With interrupts enabled
+ * none of them is more than about 30 bytes deep: the entry function
+ * plus the prologue of the kernel call it blocks in. The deepest of
+ * those calls is avr_thread_wait_next_period() or
+ * avr_thread_sleep_ms(), which keep 32-bit times in registers. Any
+ * interrupt can land on top of that. The timebase slow path and
+ * AVR_THREAD_ISR() handlers push a 35-byte frame, and then
+ * avr_thread_isr_exit() and avr_thread_tick() run their calls on the
+ * same stack, roughly 60 bytes more. 160 bytes covers that plus
+ * STACK_MARGIN. These are estimates: check avr_thread_stack_unused()
+ * on the target after changing any of these threads.
+ */
+#define SMALL_STACK_SIZE 160
+
+uint8_t         key_stack[SMALL_STACK_SIZE],
+                led_stack[SMALL_STACK_SIZE],
                 save_stack[300];
 
+#ifdef TRACE
+/*
+ * Sends the scheduler trace over the UART. Decode it on the host with
+ * `trace2json.py'.
+ */
+AVR_THREAD_STATIC(trace_thread, SMALL_STACK_SIZE);
+
+/*
+ * Every record goes out as a sync byte followed by the record itself.
+ */
+#define TRACE_SYNC 0xfe
+#endif
+
 /*
  * Prototypes
  */
@@ -112,7 +191,7 @@ void            loop(void);
 
 void            draw_splash(void);
 
-void            flash_screen(int n, int ms);
+void            flash_screen(int n, int steps);
 
 void            clear_board(void);
 
@@ -120,6 +199,8 @@ void            draw_board(void);
 
 void            swipe_image(uint8_t * new_image);
 
+void            show_slate(uint16_t refreshes);
+
 void            heavy(void);
 
 void            next_player(void);
@@ -130,6 +211,10 @@ void            flash_three(void);
 
 void            player_move(void);
 
+void            player_input(uint8_t button);
+
+void            send_button(uint8_t button);
+
 void            computer_move(void);
 
 int             calculate_score(uint8_t col);
@@ -142,18 +227,31 @@ void            save_point_entry(void);
 
 void            save_game(void);
 
+void            mark_game_changed(void);
+
 void            restore_game(void);
 
+#ifdef TRACE
+void            trace_entry(void);
+#endif
+
 
 void
 button_buffer_entry(void)
 {
     while (1) {
-        avr_thread_mutex_lock(mutex_button_pressed);
+        /*
+         * Sleep until a button changes instead of polling them.
+         */
+        avr_thread_event_wait(&button_event, BUTTON_CHANGED,
+                              AVR_THREAD_EVENT_CLEAR);
+        avr_thread_sleep_ms(BUTTON_DEBOUNCE);
+        avr_thread_event_clear(&button_event, BUTTON_CHANGED);
+
         meggyjr_check_button_pressed();
         if (meggyjr_button_a) {
             avr_thread_resume(led_thread);
-            button_a = 1;
+            send_button(button_a);
         }
         if (meggyjr_button_b) {
             avr_thread_pause(led_thread);
@@ -161,28 +259,44 @@ button_buffer_entry(void)
         }
         if (meggyjr_button_up) {
             avr_thread_cancel(led_thread);
-            button_up = 1;
+            send_button(button_up);
         }
         if (meggyjr_button_down) {
-            button_down = 1;
+            send_button(button_down);
         }
         if (meggyjr_button_left) {
-            button_left = 1;
+            send_button(button_left);
         }
         if (meggyjr_button_right) {
-            button_right = 1;
+            send_button(button_right);
         }
-        avr_thread_mutex_unlock(mutex_button_pressed);
-        avr_thread_yield();
     }
 }
 
+/*
+ * Blocks while the game is BUTTON_QUEUE_SIZE presses behind.
+ */
+void
+send_button(uint8_t button)
+{
+    avr_thread_queue_send(&button_queue, &button);
+}
+
+/*
+ * The buttons are on PC0..PC5. The button thread gets to run as soon as
+ * this returns.
+ */
+AVR_THREAD_ISR(PCINT1_vect)
+{
+    avr_thread_event_set_from_isr(&button_event, BUTTON_CHANGED);
+}
+
 void
 led_entry(void)
 {
     while (1) {
         meggyjr_set_led(dataLights);
-        avr_thread_sleep(10);
+        avr_thread_wait_next_period();
         dataLights = (dataLights << 1) | (dataLights >> 7);
     }
 }
@@ -190,14 +304,44 @@ led_entry(void)
 void
 save_point_entry(void)
 {
+    avr_thread_mutex_lock(mutex_save_point);
     while (1) {
-        avr_thread_mutex_lock(mutex_save_point);
+        while (!game_changed) {
+            avr_thread_cond_wait(&save_point_cond, mutex_save_point);
+        }
+        game_changed = 0;
         save_game();
-        avr_thread_mutex_unlock(mutex_save_point);
-        avr_thread_yield();
     }
 }
 
+/*
+ * Has the save point thread save the game.
+ */
+void
+mark_game_changed(void)
+{
+    avr_thread_mutex_lock(mutex_save_point);
+    game_changed = 1;
+    avr_thread_cond_signal(&save_point_cond);
+    avr_thread_mutex_unlock(mutex_save_point);
+}
+
+#ifdef TRACE
+void
+trace_entry(void)
+{
+    struct avr_thread_trace_record r;
+
+    while (1) {
+        while (avr_thread_trace_read(&r)) {
+            uart_putc(TRACE_SYNC);
+            uart_write(&r, sizeof r);
+        }
+        avr_thread_sleep_ms(10);
+    }
+}
+#endif
+
 int
 main(void)
 {
@@ -205,24 +349,35 @@ main(void)
     meggyjr_clear_slate();
     main_thread = avr_thread_init(300, atp_normal);
 
-    button_a = 0;
-    button_up = 0;
-    button_down = 0;
-    button_left = 0;
-    button_right = 0;
+    avr_thread_queue_init_static(&button_queue, button_queue_buffer,
+                                 sizeof button_queue_buffer[0],
+                                 BUTTON_QUEUE_SIZE);
+    mutex_save_point = avr_thread_mutex_init_static(&save_point_storage);
+    avr_thread_cond_init_static(&save_point_cond);
+    avr_thread_event_init_static(&button_event);
 
-    mutex_button_pressed = avr_thread_mutex_init();
-    mutex_save_point = avr_thread_mutex_init();
+    button_thread =
+        avr_thread_create_static(&button_thread_storage,
+                                 button_buffer_entry, key_stack,
+                                 sizeof key_stack, atp_normal);
 
-    button_thread = avr_thread_create(button_buffer_entry, key_stack,
-                                      sizeof key_stack, atp_normal);
-
-    led_thread = avr_thread_create(led_entry, led_stack,
-                                   sizeof led_stack, atp_normal);
+    led_thread =
+        avr_thread_create_periodic_static(&led_thread_storage, led_entry,
+                                          led_stack, sizeof led_stack,
+                                          atp_normal, LED_PERIOD);
 
     save_point_thread =
-        avr_thread_create(save_point_entry, save_stack,
-                          sizeof save_stack, atp_normal);
+        avr_thread_create_static(&save_point_thread_storage,
+                                 save_point_entry, save_stack,
+                                 sizeof save_stack, atp_normal);
+
+    PCMSK1 = 0x3f;
+    PCICR |= (1 << PCIE1);
+
+#ifdef TRACE
+    uart_init();
+    AVR_THREAD_CREATE_STATIC(trace_thread, trace_entry, atp_lowest);
+#endif
 
     restore_game();
 
@@ -247,7 +402,6 @@ restore_game(void)
         draw_board();
         game_over = 0;
         tone_current = 0;
-        button_a = 0;
         sound_enabled = 1;
         dataLights = 3;
 
@@ -269,31 +423,12 @@ restore_game(void)
 void
 loop(void)
 {
-    avr_thread_mutex_lock(mutex_button_pressed);
+    uint8_t         button;
 
-    if (button_a) {
-        xc = 6;
-        yc = 6;
-
-        player_turn = 1;
-        draw_splash();
-        draw_board();
-        game_over = 0;
-        tone_current = 0;
-        button_a = 0;
-        sound_enabled = 1;
-        dataLights = 3;
+    while (avr_thread_queue_try_receive(&button_queue, &button)) {
+        player_input(button);
     }
 
-    if (button_up) {
-        sound_enabled = !sound_enabled;
-        if (sound_enabled) {
-            meggyjr_tone_start(ToneC5, 30);
-        }
-        button_up = 0;
-    }
-
-    avr_thread_mutex_unlock(mutex_button_pressed);
     if (game_over) {
         meggyjr_draw(xc, yc, Dark);
         flash_three();
@@ -327,17 +462,16 @@ draw_splash(void)
         for (i = 0; i < 8; ++i) {
             meggyjr_draw(i, j, player_colors[0]);
             meggyjr_draw(7 - i, 7 - j, player_colors[1]);
-            meggyjr_display_slate();
-            avr_thread_sleep(1);
+            show_slate(STEP_REFRESHES);
         }
     }
 
-    avr_thread_sleep(1);
+    show_slate(STEP_REFRESHES);
     flash_screen(4, 3);
 }
 
 void
-flash_screen(int n, int ms)
+flash_screen(int n, int steps)
 {
     uint8_t         count,
                     i,
@@ -351,15 +485,13 @@ flash_screen(int n, int ms)
                 meggyjr_draw(i, j, Dark);
             }
         }
-        meggyjr_display_slate();
-        avr_thread_sleep(ms);
+        show_slate(steps * STEP_REFRESHES);
         for (j = 0; j < 8; ++j) {
             for (i = 0; i < 8; ++i) {
                 meggyjr_draw(i, j, save_screen[8 * j + i]);
             }
         }
-        meggyjr_display_slate();
-        avr_thread_sleep(ms);
+        show_slate(steps * STEP_REFRESHES);
     }
 }
 
@@ -380,8 +512,7 @@ clear_board(void)
                            30);
     }
 
-    meggyjr_display_slate();
-    avr_thread_sleep(1);
+    show_slate(STEP_REFRESHES);
 }
 
 void
@@ -433,13 +564,25 @@ swipe_image(uint8_t * new_image)
 {
     uint8_t         i,
                     j;
-    int             wait = 1;
+    int             wait = STEP_REFRESHES;
     for (j = 0; j < 8; ++j) {
         for (i = 0; i < 8; ++i) {
             meggyjr_draw(i, j, new_image[8 * j + i]);
         }
-        meggyjr_display_slate();
-        avr_thread_sleep(wait);
+        show_slate(wait);
+    }
+}
+
+/*
+ * Shows the slate and keeps it up for `refreshes' display refreshes, so
+ * that animations move in step with the display.
+ */
+void
+show_slate(uint16_t refreshes)
+{
+    meggyjr_display_slate();
+    for (; refreshes > 0; --refreshes) {
+        meggyjr_wait_vsync();
     }
 }
 
@@ -449,7 +592,7 @@ heavy()
     int             row,
                     wait;
     avr_thread_mutex_lock(mutex_save_point);
-    wait = 4;
+    wait = 4 * STEP_REFRESHES;
 
     row = yc;
 
@@ -458,8 +601,7 @@ heavy()
         while (meggyjr_read_pixel(xc, row) == Dark && row >= 0) {
             meggyjr_draw(xc, row + 1, Dark);
             meggyjr_draw(xc, row, player_colors[player_turn]);
-            meggyjr_display_slate();
-            avr_thread_sleep(wait);
+            show_slate(wait);
             --row;
         }
         row++;
@@ -469,6 +611,8 @@ heavy()
             tone_current = 0;
         }
         next_player();
+        game_changed = 1;
+        avr_thread_cond_signal(&save_point_cond);
     }
     avr_thread_mutex_unlock(mutex_save_point);
 }
@@ -618,56 +762,97 @@ flash_three(void)
         save[i] = meggyjr_read_pixel(cols[i], rows[i]);
         meggyjr_draw(cols[i], rows[i], player_colors[2]);
     }
-    meggyjr_display_slate();
-    avr_thread_sleep(1);
+    show_slate(STEP_REFRESHES);
 
     for (i = 0; i < 3; ++i) {
         meggyjr_draw(cols[i], rows[i], save[i]);
     }
-    meggyjr_display_slate();
-    avr_thread_sleep(3);
+    show_slate(3 * STEP_REFRESHES);
 }
 
+/*
+ * Acts on a button press. The arrows and the drop only count on the
+ * player's turn.
+ */
 void
-player_move(void)
+player_input(uint8_t button)
 {
-    avr_thread_mutex_lock(mutex_button_pressed);
+    switch (button) {
+    case button_a:
+        xc = 6;
+        yc = 6;
 
-    if (button_down) {
+        player_turn = 1;
+        draw_splash();
+        draw_board();
+        game_over = 0;
+        tone_current = 0;
+        sound_enabled = 1;
+        dataLights = 3;
+        mark_game_changed();
+        break;
+
+    case button_up:
+        sound_enabled = !sound_enabled;
+        if (sound_enabled) {
+            meggyjr_tone_start(ToneC5, 30);
+        }
+        mark_game_changed();
+        break;
+
+    case button_down:
+        if (game_over || player_turn != 1) {
+            break;
+        }
         heavy();
         if (sound_enabled) {
             meggyjr_tone_start(ToneD5, 20);
         }
-        button_down = 0;
-    }
+        break;
 
-    if (button_right) {
+    case button_right:
+        if (game_over || player_turn != 1) {
+            break;
+        }
         if (xc < 6) {
             meggyjr_draw(xc, yc, Dark);
             xc = (xc + 1) % 8;
             if (sound_enabled) {
                 meggyjr_tone_start(ToneD5, 20);
             }
+            mark_game_changed();
         }
-        button_right = 0;
-    }
+        break;
 
-    if (button_left) {
+    case button_left:
+        if (game_over || player_turn != 1) {
+            break;
+        }
         if (xc > 1) {
             meggyjr_draw(xc, yc, Dark);
             xc = (xc - 1) % 8;
             if (sound_enabled) {
                 meggyjr_tone_start(ToneC5, 20);
             }
+            mark_game_changed();
         }
-        button_left = 0;
+        break;
     }
+}
 
-    avr_thread_mutex_unlock(mutex_button_pressed);
+void
+player_move(void)
+{
+    uint8_t         button;
 
     meggyjr_draw(xc, yc, player_colors[player_turn]);
     meggyjr_display_slate();
-    avr_thread_sleep(1);
+
+    /*
+     * Nothing changes on screen until the player presses something.
+     */
+    avr_thread_queue_receive(&button_queue, &button);
+    player_input(button);
 }
 
 void
@@ -679,8 +864,7 @@ computer_move(void)
     for (; xc > 1; --xc) {
         meggyjr_draw(xc, yc, Dark);
         meggyjr_draw(xc - 1, yc, player_colors[player_turn]);
-        meggyjr_display_slate();
-        avr_thread_sleep(3);
+        show_slate(3 * STEP_REFRESHES);
     }
     max_score = -1;
     for (; xc < 6; ++xc) {
@@ -707,8 +891,7 @@ computer_move(void)
         }
         meggyjr_draw(xc, yc, Dark);
         meggyjr_draw(xc - 1, yc, player_colors[player_turn]);
-        meggyjr_display_slate();
-        avr_thread_sleep(3);
+        show_slate(3 * STEP_REFRESHES);
     }
 
     heavy();
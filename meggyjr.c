@@ -17,6 +17,8 @@
  * along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <avr/interrupt.h>
+
 #include "meggyjr.h"
 #include "meggyjr_basic.h"
 
@@ -28,6 +30,12 @@ volatile uint8_t meggyjr_button_left;
 volatile uint8_t meggyjr_button_right;
 
 static volatile uint8_t meggyjr_game_slate[DIMENSION][DIMENSION];
+
+/*
+ * Bit x is set when column x of the slate has changed since it was last
+ * encoded by meggyjr_display_slate().
+ */
+static volatile uint8_t meggyjr_dirty_columns;
 static volatile uint8_t last_button_state;
 
 // Color lookup Table
@@ -137,7 +145,14 @@ meggyjr_set_led_binary(uint8_t n)
 inline void
 meggyjr_draw(uint8_t x, uint8_t y, uint8_t colour)
 {
+    uint8_t         sreg;
+
     meggyjr_game_slate[x][y] = colour;
+
+    sreg = SREG;
+    cli();
+    meggyjr_dirty_columns |= 1 << x;
+    SREG = sreg;
 }
 
 inline          uint8_t
@@ -157,21 +172,60 @@ meggyjr_clear_slate(void)
             meggyjr_game_slate[i][j] = 0;
         }
     }
+    meggyjr_dirty_columns = 0xff;
 }
 
+/*
+ * Encodes the columns of the slate drawn on since the last call into the
+ * bit-planes the display ISR shifts out, so that the ISR itself only has
+ * to load bytes, and shows them from the next vsync on.
+ */
 void
 meggyjr_display_slate(void)
 {
     uint8_t         i,
-                    j;
+                    j,
+                    k,
+                    c;
+    uint8_t         bit;
+    uint8_t         dirty;
+    uint8_t         sreg;
+    uint8_t        *rgb;
+    uint8_t         column[BCM_PLANES][3];
 
-    for (i = 0; i < 8; ++i) {
-        for (j = 0; j < 8; ++j) {
-            meggyjr_set_pixel_color(i, j,
-                                    meggyjr_colour_table
-                                    [meggyjr_game_slate[i][j]]);
+    /*
+     * A column drawn on from now on is encoded by the next call.
+     */
+    sreg = SREG;
+    cli();
+    dirty = meggyjr_dirty_columns;
+    meggyjr_dirty_columns = 0;
+    SREG = sreg;
+
+    if (dirty == 0) {
+        return;
+    }
+
+    for (i = 0; i < 8; ++i, dirty >>= 1) {
+        if (!(dirty & 1)) {
+            continue;
+        }
+        for (k = 0; k < BCM_PLANES; ++k) {
+            column[k][0] = column[k][1] = column[k][2] = 0;
+        }
+        for (j = 0, bit = 1; j < 8; ++j, bit <<= 1) {
+            rgb = meggyjr_colour_table[meggyjr_game_slate[i][j]];
+            for (c = 0; c < 3; ++c) {
+                for (k = 0; k < BCM_PLANES; ++k) {
+                    if (rgb[c] & (1 << k)) {
+                        column[k][c] |= bit;
+                    }
+                }
+            }
         }
+        meggyjr_set_column(i, column);
     }
+    meggyjr_flip();
 }
 
 inline void
@@ -94,7 +94,10 @@ void            meggyjr_clear_slate(void);
  * Flushes the buffer.
  *
  * When meggyjr_draw() is called, the update will not immediately take
- * effect. This function should be used to flush the buffer.
+ * effect. This function should be used to flush the buffer. Only the
+ * columns drawn on since the last call are converted again. The new
+ * slate is shown from the next vsync on; calling this again before then
+ * waits for it, so nothing is drawn faster than it can be shown.
  */
 void            meggyjr_display_slate(void);
 
@@ -26,12 +26,44 @@
 
 #define F_CPU 16000000UL
 
-static volatile uint8_t frame[DISP_BUFFER_SIZE];
+/*
+ * One bit-plane unit in Timer2 counts at clk/64. A column is lit for
+ * MAX_BT units over its BCM_PLANES planes, so the whole display still
+ * refreshes FPS times a second.
+ */
+#define BCM_UNIT (F_CPU / 64 / 8 / MAX_BT / FPS)
+
 volatile uint8_t leds;
 
+/*
+ * Binary code modulation: planes[b][x][k] holds the three bytes of
+ * buffer b shifted out for column x while bit k of every intensity is
+ * shown, in the order they go out (red, green, blue; bit y is row y).
+ * Plane k is shown for 2^k units, so a pixel is lit for exactly its
+ * intensity. This is the only copy of the frame; the pixel getters read
+ * it back out of the planes.
+ *
+ * There are two buffers. The ISR scans planes[front] while drawing goes
+ * to the other one, and swaps them when the scan gets back to column 0
+ * after meggyjr_flip(), so that a frame is never shown half drawn.
+ */
+static volatile uint8_t planes[2][8][BCM_PLANES][3];
+static volatile uint8_t front;
+static volatile uint8_t flip_pending;
+static volatile uint8_t back_stale;
+
+/*
+ * Set at every vsync, i.e., whenever the scan wraps to column 0. The
+ * refresh ISR only arms a one-shot compare B interrupt at the wrap, and
+ * that one sets the event: calling into the kernel from the refresh ISR
+ * would make it save every call-clobbered register on every plane.
+ */
+#define VSYNC 0x01
+#define VSYNC_DELAY (BCM_UNIT / 2)
+static struct avr_thread_event vsync_event;
+
 static volatile uint8_t current_column;
-static volatile uint8_t *current_column_ptr;
-static volatile uint8_t current_brightness;
+static volatile uint8_t current_plane;
 
 static volatile unsigned int tone_time_remaining;
 static volatile uint8_t sound_enabled;
@@ -39,10 +71,21 @@ static volatile uint8_t sound_enabled;
 void
 meggyjr_init(void)
 {
+    uint8_t         i;
+    volatile uint8_t *plane;
+
     leds = 0;
-    current_column_ptr = frame;
     current_column = 0;
-    current_brightness = 0;
+    current_plane = 0;
+
+    front = 0;
+    flip_pending = 0;
+    back_stale = 0;
+    plane = planes[0][0][0];
+    for (i = 0; i < sizeof(planes); ++i) {
+        plane[i] = 0;
+    }
+    avr_thread_event_init_static(&vsync_event);
 
     PORTC = 255U;
     DDRC = 0;
@@ -63,64 +106,176 @@ meggyjr_init(void)
     meggyjr_clear_frame();
 
     TCCR2A = (1 << WGM21);
-    TCCR2B = (1 << CS21);
-    OCR2A = (F_CPU >> 3) / 8 / 15 / FPS;
+    TCCR2B = (1 << CS22);
+    OCR2A = BCM_UNIT - 1;
     TIMSK2 = (1 << OCIE2A);
 
     sei();
 }
 
+/*
+ * Returns the index of the buffer to draw on, once it may be drawn on:
+ * while a flip is pending the back buffer is about to be shown, so wait
+ * for it. After a flip the back buffer holds the frame before the one
+ * shown, so bring it up to date first.
+ */
+static uint8_t
+meggyjr_back(void)
+{
+    uint8_t         i;
+    volatile uint8_t *src;
+    volatile uint8_t *dst;
+
+    while (flip_pending) {
+        meggyjr_wait_vsync();
+    }
+    if (back_stale) {
+        src = planes[front][0][0];
+        dst = planes[front ^ 1][0][0];
+        for (i = 0; i < sizeof(planes[0]); ++i) {
+            dst[i] = src[i];
+        }
+        back_stale = 0;
+    }
+    return front ^ 1;
+}
+
+/*
+ * Returns the index of the buffer holding the latest frame drawn,
+ * without waiting.
+ */
+static uint8_t
+meggyjr_latest(void)
+{
+    return (back_stale && !flip_pending) ? front : front ^ 1;
+}
+
 void
 meggyjr_clear_frame(void)
 {
     uint8_t         i;
+    volatile uint8_t *plane;
+
     // I hope this can be as fast as memset(3).
-    for (i = 0; i < DISP_BUFFER_SIZE; ++i) {
-        frame[i] = 0;
+    plane = planes[meggyjr_back()][0][0];
+    for (i = 0; i < sizeof(planes[0]); ++i) {
+        plane[i] = 0;
     }
 }
 
+void
+meggyjr_flip(void)
+{
+    /*
+     * Nothing may have been drawn since the last flip, and the back
+     * buffer must not go up a frame behind.
+     */
+    meggyjr_back();
+    flip_pending = 1;
+}
+
+void
+meggyjr_wait_vsync(void)
+{
+    avr_thread_event_clear(&vsync_event, VSYNC);
+    avr_thread_event_wait(&vsync_event, VSYNC, AVR_THREAD_EVENT_ANY);
+}
+
+/*
+ * Spreads the intensity of one colour of pixel (x, y) over the bit-planes
+ * of column x. `channel' is the byte within a plane: 0 for red, 1 for
+ * green and 2 for blue.
+ */
+static void
+meggyjr_set_planes(uint8_t x, uint8_t y, uint8_t channel, uint8_t value)
+{
+    volatile uint8_t *plane;
+    uint8_t         bit;
+    uint8_t         k;
+
+    if (value > MAX_BT) {
+        value = MAX_BT;
+    }
+    plane = &planes[meggyjr_back()][x][0][channel];
+    bit = 1 << y;
+    for (k = 0; k < BCM_PLANES; ++k) {
+        if (value & 1) {
+            *plane |= bit;
+        } else {
+            *plane &= ~bit;
+        }
+        value >>= 1;
+        plane += 3;
+    }
+}
+
+/*
+ * The inverse of meggyjr_set_planes().
+ */
+static uint8_t
+meggyjr_get_planes(uint8_t x, uint8_t y, uint8_t channel)
+{
+    volatile uint8_t (*column)[3];
+    uint8_t         value;
+    uint8_t         bit;
+    uint8_t         k;
+
+    column = planes[meggyjr_latest()][x];
+    value = 0;
+    bit = 1 << y;
+    for (k = BCM_PLANES; k-- > 0;) {
+        value <<= 1;
+        if (column[k][channel] & bit) {
+            value |= 1;
+        }
+    }
+    return value;
+}
+
 void
 meggyjr_set_pixel_color(uint8_t x, uint8_t y, uint8_t * rgb)
 {
-    uint8_t         pixelPtr;
-
-    pixelPtr = (uint8_t) 24 *x + y;
-    frame[pixelPtr] = rgb[2];
-    pixelPtr += 8;
-    frame[pixelPtr] = rgb[1];
-    pixelPtr += 8;
-    frame[pixelPtr] = rgb[0];
+    meggyjr_set_planes(x, y, 0, rgb[0]);
+    meggyjr_set_planes(x, y, 1, rgb[1]);
+    meggyjr_set_planes(x, y, 2, rgb[2]);
+}
+
+void
+meggyjr_set_column(uint8_t x, uint8_t column[BCM_PLANES][3])
+{
+    volatile uint8_t *plane;
+    uint8_t         i;
+
+    plane = planes[meggyjr_back()][x][0];
+    for (i = 0; i < BCM_PLANES * 3; ++i) {
+        plane[i] = column[0][i];
+    }
 }
 
 inline          uint8_t
 meggyjr_get_pixel_red(uint8_t x, uint8_t y)
 {
-    return frame[24 * x + y + 16];
+    return meggyjr_get_planes(x, y, 0);
 }
 
 inline          uint8_t
 meggyjr_get_pixel_green(uint8_t x, uint8_t y)
 {
-    return frame[24 * x + y + 8];
+    return meggyjr_get_planes(x, y, 1);
 }
 
 inline          uint8_t
 meggyjr_get_pixel_blue(uint8_t x, uint8_t y)
 {
-    return frame[24 * x + y];
+    return meggyjr_get_planes(x, y, 2);
 }
 
 void
 meggyjr_clear_pixel(uint8_t x, uint8_t y)
 {
-    uint8_t         pixelPtr;
-    pixelPtr = 24 * x + y;
-    frame[pixelPtr] = 0;
-    pixelPtr += 8;
-    frame[pixelPtr] = 0;
-    pixelPtr += 8;
-    frame[pixelPtr] = 0;
+    meggyjr_set_planes(x, y, 0, 0);
+    meggyjr_set_planes(x, y, 1, 0);
+    meggyjr_set_planes(x, y, 2, 0);
 }
 
 inline          uint8_t
@@ -160,82 +315,47 @@ meggyjr_set_sound_state(uint8_t t)
     }
 }
 
-static volatile uint8_t num_redraws = 0;
-static volatile uint8_t *ptr;
-static uint8_t  p;
-static uint8_t  cb;
-static uint8_t  bits;
-static uint8_t  portbTemp;
-static uint8_t  portdTemp;
+/*
+ * Sends `b' once the previous byte is out. At fosc/4 a byte takes 32
+ * cycles, less than entering and leaving an SPI interrupt would, so
+ * waiting is the cheapest way to keep the SPI busy.
+ */
+static inline void
+meggyjr_spi_send(uint8_t b)
+{
+    while (!(SPSR & (1 << SPIF))) {
+    }
+    SPDR = b;
+}
 
 /**
  * ISR
  *
- * Here is the ISR.
+ * Here is the ISR. It only refreshes the display; the scheduler has its
+ * own timebase, so a plain ISR that saves just the registers it uses is
+ * enough.
+ *
+ * Each interrupt shows one bit-plane of one column and sets the compare
+ * value so that the plane stays up for its weight, which takes
+ * BCM_PLANES interrupts per column instead of MAX_BT.
  **/
-ISR(TIMER2_COMPA_vect, ISR_NAKED)
+ISR(TIMER2_COMPA_vect)
 {
-    __asm__("push r0");
-    __asm__("in r0, __SREG__");
-    __asm__("cli");
-    __asm__("push r0");
-    __asm__("push r1");
-    __asm__("push r2");
-    __asm__("push r3");
-    __asm__("push r4");
-    __asm__("push r5");
-    __asm__("push r6");
-    __asm__("push r7");
-    __asm__("push r8");
-    __asm__("push r9");
-    __asm__("push r10");
-    __asm__("push r11");
-    __asm__("push r12");
-    __asm__("push r13");
-    __asm__("push r14");
-    __asm__("push r15");
-    __asm__("push r16");
-    __asm__("push r17");
-    __asm__("push r18");
-    __asm__("push r19");
-    __asm__("push r20");
-    __asm__("push r21");
-    __asm__("push r22");
-    __asm__("push r23");
-    __asm__("push r24");
-    __asm__("push r25");
-    __asm__("push r26");
-    __asm__("push r27");
-    __asm__("push r28");
-    __asm__("push r29");
-    __asm__("push r30");
-    __asm__("push r31");
-    __asm__("clr __zero_reg__");
-
-    if (++current_brightness >= MAX_BT) {
-        current_brightness = 0;
+    volatile uint8_t *plane;
+
+    if (++current_plane >= BCM_PLANES) {
+        current_plane = 0;
         ++current_column;
         if (current_column > 7) {
             current_column = 0;
-            current_column_ptr = frame;
-            /*
-             * You don't pay for what you don't use!
-             */
-            if (avr_thread_initialised == 1) {
-                ++num_redraws;
-                if (num_redraws == FPS / FIRE_PER_SEC) {
-                    /*
-                     * In AVR, SP is directly readable and writeable.
-                     * Yet, its type is trick. It is uint16_t according
-                     * to the manual of AVR Libc. Thus, I need to do
-                     * two conversions.
-                     */
-                    SP = (uint16_t) avr_thread_tick((uint8_t *) SP);
-                    num_redraws = 0;
-                }
+            if (flip_pending) {
+                front ^= 1;
+                back_stale = 1;
+                flip_pending = 0;
             }
-        } else {
-            current_column_ptr += 24;   // 3 * 8
+            OCR2B = VSYNC_DELAY;
+            TIFR2 = (1 << OCF2B);
+            TIMSK2 |= (1 << OCIE2B);
         }
 
         if (tone_time_remaining > 0) {
@@ -249,195 +369,58 @@ ISR(TIMER2_COMPA_vect, ISR_NAKED)
         }
     }
 
-    ptr = current_column_ptr + 23;
-    cb = current_brightness;
+    OCR2A = (BCM_UNIT << current_plane) - 1;
+    plane = planes[front][current_column][current_plane];
 
     PORTD |= 252U;
     PORTB |= 17U;
 
-    SPCR = 80;
-
-    if ((cb + current_column) == 0 || (cb + current_column) == 4) {
+    SPCR = (1 << SPE) | (1 << MSTR);
+
+    /*
+     * The auxiliary LEDs used to go out when brightness + column was 0
+     * or 4: two units in column 0 and one in each of columns 1 to 4.
+     * The weight-2 plane of column 0 and the weight-1 plane of columns
+     * 1 to 4 keep them as bright as they were.
+     *
+     * The SPI is idle here, so the first byte goes out without waiting.
+     */
+    if (current_column == 0 ? current_plane == 1
+        : (current_plane == 0 && current_column <= 4)) {
         SPDR = leds;
     } else {
         SPDR = 0;
     }
 
-    bits = 0;
-
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 128;
-    }
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 64;
-    }
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 32;
-    }
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 16;
-    }
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 8;
-    }
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 4;
-    }
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 2;
-    }
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 1;
-    }
-
-    SPDR = bits;
-
-    bits = 0;
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 128;
-    }
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 64;
-    }
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 32;
-    }
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 16;
-    }
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 8;
-    }
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 4;
-    }
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 2;
-    }
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 1;
-    }
-
-    while (!(SPSR && (1 << SPIF))) {
-        // First Spin;
-    }
-    SPDR = bits;
+    meggyjr_spi_send(plane[0]);
+    meggyjr_spi_send(plane[1]);
+    meggyjr_spi_send(plane[2]);
 
-    bits = 0;
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 128;
-    }
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 64;
-    }
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 32;
-    }
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 16;
-    }
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 8;
-    }
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 4;
-    }
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 2;
-    }
-    p = *ptr--;
-    if (p > cb) {
-        bits |= 1;
+    while (!(SPSR & (1 << SPIF))) {
     }
 
-    while (!(SPSR && (1 << SPIF))) {
-        // Second Spin;
-    }
-    SPDR = bits;
-
-    portbTemp = 0;
-    portdTemp = 0;
+    PORTB |= 4;
 
     if (current_column == 0) {
-        portbTemp = 239U;
+        PORTB &= 239U;
     } else if (current_column == 1) {
-        portbTemp = 254U;
-    } else {
-        portdTemp = ~(1 << (9 - current_column));
-    }
-
-    while (!(SPSR && (1 << SPIF))) {
-        // Third Spin;
-    }
-
-    PORTB |= 4;
-
-    if (current_column > 1) {
-        PORTD &= portdTemp;
+        PORTB &= 254U;
     } else {
-        PORTB &= portbTemp;
+        PORTD &= ~(1 << (9 - current_column));
     }
 
     PORTB &= 251;
 
     SPCR = 0;
+}
 
-    __asm__("pop r31");
-    __asm__("pop r30");
-    __asm__("pop r29");
-    __asm__("pop r28");
-    __asm__("pop r27");
-    __asm__("pop r26");
-    __asm__("pop r25");
-    __asm__("pop r24");
-    __asm__("pop r23");
-    __asm__("pop r22");
-    __asm__("pop r21");
-    __asm__("pop r20");
-    __asm__("pop r19");
-    __asm__("pop r18");
-    __asm__("pop r17");
-    __asm__("pop r16");
-    __asm__("pop r15");
-    __asm__("pop r14");
-    __asm__("pop r13");
-    __asm__("pop r12");
-    __asm__("pop r11");
-    __asm__("pop r10");
-    __asm__("pop r9");
-    __asm__("pop r8");
-    __asm__("pop r7");
-    __asm__("pop r6");
-    __asm__("pop r5");
-    __asm__("pop r4");
-    __asm__("pop r3");
-    __asm__("pop r2");
-    __asm__("pop r1");
-    __asm__("pop r0");
-    __asm__("out __SREG__,r0");
-    __asm__("pop r0");
-    __asm__("reti");
+/*
+ * Runs once per frame, VSYNC_DELAY counts into the first plane of column
+ * 0. The refresh ISR that armed it clears the flag before the counter
+ * gets there, so this one comes in right after it has returned.
+ */
+ISR(TIMER2_COMPB_vect)
+{
+    TIMSK2 &= ~(1 << OCIE2B);
+    avr_thread_event_set_from_isr(&vsync_event, VSYNC);
 }
@@ -24,8 +24,8 @@
 #include <avr/io.h>
 #define byte uint8_t
 
-#define DISP_BUFFER_SIZE 192
 #define MAX_BT 15
+#define BCM_PLANES 4
 #define FPS 120
 #define F_CPU 16000000UL
 
@@ -109,6 +109,26 @@ void            meggyjr_clear_frame(void);
 
 void            meggyjr_set_pixel_color(byte x, byte y, byte * rgb);
 
+/*
+ * Replaces column x with bit-planes already laid out the way the refresh
+ * ISR shifts them out: column[k] is bit k of the red, green and blue
+ * intensities, with row y in bit y of each byte.
+ */
+void            meggyjr_set_column(byte x, byte column[BCM_PLANES][3]);
+
+/*
+ * Drawing goes to a back buffer that is not on the display. This shows
+ * it from the next vsync on, when the scan gets back to column 0. The
+ * next call that draws waits for that vsync first.
+ */
+void            meggyjr_flip(void);
+
+/*
+ * Blocks the calling thread until the next vsync, i.e., until the
+ * display has been refreshed once more, at FPS times a second.
+ */
+void            meggyjr_wait_vsync(void);
+
 byte            meggyjr_get_pixel_red(byte x, byte y);
 
 byte            meggyjr_get_pixel_green(byte x, byte y);
@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2012       Meitian Huang <_@freeaddr.info>
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+#
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in
+#    the documentation and/or other materials provided with the
+#    distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+# EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+# PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+# PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+# OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+"""
+Turns the scheduler trace sent by a -DTRACE build into Chrome trace JSON,
+to be opened with chrome://tracing or https://ui.perfetto.dev.
+
+Capture the UART first, e.g.:
+
+    stty -F /dev/ttyUSB0 115200 raw
+    cat /dev/ttyUSB0 > trace.bin
+    ./trace2json.py trace.bin > trace.json
+
+Each record is a sync byte (0xfe) followed by `struct
+avr_thread_trace_record' as laid out by avr-gcc with -fpack-struct.
+"""
+
+import argparse
+import json
+import struct
+import sys
+
+SYNC = 0xfe
+RECORD = struct.Struct("<BBBBH")
+
+# enum avr_thread_trace_event
+EVENTS = ["switch", "wake", "block", "exit", "lock", "unlock", "lost"]
+
+# enum avr_thread_state
+STATES = ["invalid", "runnable", "paused", "sleeping", "joined",
+          "cancelled", "waiting"]
+
+# One timebase count is 64 CPU cycles.
+US_PER_COUNT = 64 / 16.0
+
+
+def records(data):
+    """Yields (event, thread, arg, tcnt, ms) tuples, resynchronising on
+    garbage such as a record cut in half when the capture started."""
+    i = 0
+    while i + 1 + RECORD.size <= len(data):
+        if data[i] != SYNC:
+            i += 1
+            continue
+        rec = RECORD.unpack_from(data, i + 1)
+        if rec[0] >= len(EVENTS):
+            i += 1
+            continue
+        yield rec
+        i += 1 + RECORD.size
+
+
+def convert(data, names):
+    out = []
+    pid = 1
+    mutex_pid = 2
+    seen = set()
+    running = None
+    base = 0
+    last_ms = None
+
+    def thread_name(tid):
+        return names.get(tid, {0: "main", 1: "idle"}.get(tid,
+                                                         "thread %d" % tid))
+
+    for event, thread, arg, tcnt, ms in records(data):
+        # `ms' is 16 bits wide; assume fewer than 65 seconds between
+        # records.
+        if last_ms is not None and ms < last_ms:
+            base += 0x10000
+        last_ms = ms
+        ts = (base + ms) * 1000 + tcnt * US_PER_COUNT
+        name = EVENTS[event]
+
+        if thread not in seen:
+            seen.add(thread)
+            out.append({"ph": "M", "name": "thread_name", "pid": pid,
+                        "tid": thread,
+                        "args": {"name": thread_name(thread)}})
+
+        if name == "switch":
+            if running is not None:
+                out.append({"ph": "E", "pid": pid, "tid": running,
+                            "ts": ts})
+            out.append({"ph": "B", "name": "running", "pid": pid,
+                        "tid": thread, "ts": ts})
+            running = thread
+        elif name in ("lock", "unlock"):
+            # Hold times go on a track per mutex.
+            out.append({"ph": "B" if name == "lock" else "E",
+                        "name": thread_name(thread), "pid": mutex_pid,
+                        "tid": arg, "ts": ts})
+        else:
+            args = {}
+            if name == "block":
+                args["state"] = (STATES[arg] if arg < len(STATES)
+                                 else arg)
+            elif name == "lost":
+                args["records"] = arg
+            out.append({"ph": "i", "s": "t", "name": name, "pid": pid,
+                        "tid": thread, "ts": ts, "args": args})
+
+    out.append({"ph": "M", "name": "process_name", "pid": pid,
+                "args": {"name": "threads"}})
+    out.append({"ph": "M", "name": "process_name", "pid": mutex_pid,
+                "args": {"name": "mutexes"}})
+    return {"traceEvents": out, "displayTimeUnit": "ms"}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("input", nargs="?", help="raw capture (default: "
+                        "standard input)")
+    parser.add_argument("-n", "--name", action="append", default=[],
+                        metavar="ID=NAME",
+                        help="name a thread, e.g. -n 2=button")
+    opts = parser.parse_args()
+
+    names = {}
+    for n in opts.name:
+        tid, _, label = n.partition("=")
+        names[int(tid)] = label
+
+    if opts.input:
+        with open(opts.input, "rb") as f:
+            data = f.read()
+    else:
+        data = sys.stdin.buffer.read()
+
+    json.dump(convert(data, names), sys.stdout)
+    sys.stdout.write("\n")
+
+
+if __name__ == "__main__":
+    main()